@@ -1,33 +1,159 @@
 #!/usr/bin/env python3
 
 # Utility script to measure performance of the VM
+#
+# The measurements are done by the VM itself (option -b), which runs the
+# program several times in-process and reports load, execution and GC
+# times separately. This script builds the requested variants of the VM,
+# records the program input, runs the benchmarks and, with --compare,
+# flags statistically significant differences between two variants.
 
 import sys
 import os
-from time import time
-import numpy as np
+import json
+import math
+import shutil
+import subprocess
+import tempfile
 
 import argparse
 
 parser = argparse.ArgumentParser(description='Do performance tests of L3 vm')
 parser.add_argument('-m', dest='heap', default="1000000", help="Heap size in bytes")
-parser.add_argument('-n', dest='n', default=1, help='Number of iterations', type=int)
-parser.add_argument('-b', dest='make', nargs='*', default='', help='Arguments passed to make')
-parser.add_argument('-s', "--silent", dest='silent', action="store_true", default=False, help='Redirect output to /dev/null')
+parser.add_argument('-n', dest='n', default=10, help='Number of measured runs', type=int)
+parser.add_argument('-w', dest='warmup', default=1, help='Number of warm-up runs', type=int)
+parser.add_argument('-b', dest='make', nargs='*', default=['vm'],
+                    help='Make targets (VM variants) to build and measure, e.g. vm stats profile')
+parser.add_argument('-c', '--compare', dest='compare', nargs=2, metavar=('BASE', 'NEW'),
+                    help='Compare two variants and flag significant regressions')
+parser.add_argument('-a', dest='alpha', default=0.05, type=float,
+                    help='Significance level of the comparison')
+parser.add_argument('-o', dest='output', help='Write the JSON results to this file')
 parser.add_argument(dest='l3', nargs='+', default='', help='The L3/ASM file and its argument')
 
 args = parser.parse_args()
-if 0 != os.system('make ' + ' '.join(args.make)):
-    exit()
-
-times = []
-for i in range(args.n):
-    start = time()
-    cmd = 'echo {} | bin/vm {} test/{}.asm {}'.format(' '.join(args.l3[1:]), '-m ' + args.heap, args.l3[0], ' > /dev/null' if args.silent else '')
-    if not args.silent:
-        print(cmd)
-    os.system(cmd)
-    times += [time()-start]
-    print('.', end='', flush=True)
-
-print('\nElapsed times: {:.6f} +/- {:.6f}'.format(np.mean(times), np.std(times)))
+
+variants = list(args.make)
+if args.compare:
+    variants += [v for v in args.compare if v not in variants]
+
+
+def build(variant):
+    """Build a variant of the VM and return the path of its binary"""
+    if 0 != os.system('make clean > /dev/null && make ' + variant):
+        sys.exit(1)
+    binary = 'bin/vm-' + variant
+    shutil.copy('bin/vm', binary)
+    return binary
+
+
+def bench(binary, input_file):
+    cmd = [binary, '-m', args.heap, '-b', str(args.n), '-B', str(args.warmup),
+           '-i', input_file, 'test/{}.asm'.format(args.l3[0])]
+    print(' '.join(cmd), file=sys.stderr)
+    output = subprocess.check_output(cmd)
+    try:
+        return json.loads(output)
+    except ValueError:
+        sys.exit('{} did not print a JSON report on its standard output:\n{}'
+                 .format(binary, output.decode(errors='replace')))
+
+
+# Student's t distribution, for Welch's t-test
+
+def betacf(a, b, x):
+    """Continued fraction of the incomplete beta function"""
+    qab, qap, qam = a + b, a + 1.0, a - 1.0
+    c, d = 1.0, 1.0 - qab * x / qap
+    d = 1.0 / (d if abs(d) > 1e-30 else 1e-30)
+    h = d
+    for m in range(1, 200):
+        m2 = 2 * m
+        aa = m * (b - m) * x / ((qam + m2) * (a + m2))
+        d = 1.0 + aa * d
+        d = 1.0 / (d if abs(d) > 1e-30 else 1e-30)
+        c = 1.0 + aa / c
+        c = c if abs(c) > 1e-30 else 1e-30
+        h *= d * c
+        aa = -(a + m) * (qab + m) * x / ((a + m2) * (qap + m2))
+        d = 1.0 + aa * d
+        d = 1.0 / (d if abs(d) > 1e-30 else 1e-30)
+        c = 1.0 + aa / c
+        c = c if abs(c) > 1e-30 else 1e-30
+        delta = d * c
+        h *= delta
+        if abs(delta - 1.0) < 1e-12:
+            break
+    return h
+
+
+def betai(a, b, x):
+    """Regularized incomplete beta function"""
+    if x <= 0.0:
+        return 0.0
+    if x >= 1.0:
+        return 1.0
+    bt = math.exp(math.lgamma(a + b) - math.lgamma(a) - math.lgamma(b)
+                  + a * math.log(x) + b * math.log(1.0 - x))
+    if x < (a + 1.0) / (a + b + 2.0):
+        return bt * betacf(a, b, x) / a
+    return 1.0 - bt * betacf(b, a, 1.0 - x) / b
+
+
+def welch(base, new):
+    """Two-sided p-value of Welch's t-test on two lists of samples"""
+    n1, n2 = len(base), len(new)
+    m1, m2 = sum(base) / n1, sum(new) / n2
+    v1 = sum((x - m1) ** 2 for x in base) / (n1 - 1)
+    v2 = sum((x - m2) ** 2 for x in new) / (n2 - 1)
+    se2 = v1 / n1 + v2 / n2
+    if se2 == 0.0:
+        return 1.0 if m1 == m2 else 0.0
+    t = (m2 - m1) / math.sqrt(se2)
+    df = se2 ** 2 / ((v1 / n1) ** 2 / (n1 - 1) + (v2 / n2) ** 2 / (n2 - 1))
+    return betai(df / 2.0, 0.5, df / (df + t * t))
+
+
+def compare(base_name, base, new_name, new):
+    print('\n{} -> {}:'.format(base_name, new_name))
+    regression = False
+    for phase in ('load', 'execution', 'gc'):
+        s1, s2 = base[phase]['samples'], new[phase]['samples']
+        m1, m2 = base[phase]['mean'], new[phase]['mean']
+        change = (m2 - m1) / m1 * 100.0 if m1 > 0 else 0.0
+        p = welch(s1, s2) if len(s1) > 1 and len(s2) > 1 else 1.0
+        significant = p < args.alpha
+        verdict = 'no significant change'
+        if significant:
+            verdict = 'REGRESSION' if m2 > m1 else 'improvement'
+            regression |= m2 > m1
+        print('  {:<10} {:.6f}s -> {:.6f}s ({:+6.2f}%)  p={:.4f}  {}'.format(
+            phase, m1, m2, change, p, verdict))
+    return regression
+
+
+with tempfile.NamedTemporaryFile('w', suffix='.in', delete=False) as input_file:
+    input_file.write(' '.join(args.l3[1:]) + '\n')
+
+try:
+    results = {}
+    for variant in variants:
+        results[variant] = bench(build(variant), input_file.name)
+finally:
+    os.unlink(input_file.name)
+
+for variant, result in results.items():
+    print('{}: execution {:.6f}s (median {:.6f}s, p99 {:.6f}s, 95% CI [{:.6f}, {:.6f}]),'
+          ' load {:.6f}s, gc {:.6f}s in {} collections'.format(
+              variant, result['execution']['mean'], result['execution']['median'],
+              result['execution']['p99'], *result['execution']['ci95'],
+              result['load']['mean'], result['gc']['mean'], result['gc_count']))
+
+if args.output:
+    with open(args.output, 'w') as out:
+        json.dump(results, out, indent=2)
+
+if args.compare:
+    base, new = args.compare
+    if compare(base, results[base], new, results[new]):
+        sys.exit(2)
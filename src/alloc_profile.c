@@ -0,0 +1,140 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "alloc_profile.h"
+#include "fail.h"
+
+typedef struct {
+  uint64_t bytes;               /* bytes allocated, headers included */
+  uint64_t objects;             /* number of blocks allocated */
+  uint64_t survived;            /* block-collections survived */
+  uint64_t died;                /* blocks freed by a collection */
+} site_stats_t;
+
+struct alloc_profile {
+  site_stats_t* sites;
+  uvalue_t site_count;
+};
+
+static site_stats_t* site_stats(alloc_profile_t* profile, uvalue_t site) {
+  uvalue_t index = site / sizeof(instr_t);
+  assert(index < profile->site_count);
+  return &profile->sites[index];
+}
+
+alloc_profile_t* alloc_profile_setup(uvalue_t code_size) {
+  alloc_profile_t* profile = malloc(sizeof(alloc_profile_t));
+  if (profile == NULL)
+    fail("cannot allocate allocation profile");
+  profile->site_count = code_size / sizeof(instr_t);
+  profile->sites = calloc(profile->site_count + 1, sizeof(site_stats_t));
+  if (profile->sites == NULL)
+    fail("cannot allocate allocation profile for %u sites",
+         profile->site_count);
+  return profile;
+}
+
+void alloc_profile_reset(alloc_profile_t* profile) {
+  memset(profile->sites, 0, (profile->site_count + 1) * sizeof(site_stats_t));
+}
+
+void alloc_profile_cleanup(alloc_profile_t* profile) {
+  free(profile->sites);
+  free(profile);
+}
+
+void alloc_profile_allocated(alloc_profile_t* profile, uvalue_t site,
+                             uvalue_t total_words) {
+  site_stats_t* s = site_stats(profile, site);
+  s->bytes += total_words * sizeof(uvalue_t);
+  s->objects += 1;
+}
+
+void alloc_profile_survived(alloc_profile_t* profile, uvalue_t site) {
+  site_stats(profile, site)->survived += 1;
+}
+
+void alloc_profile_died(alloc_profile_t* profile, uvalue_t site) {
+  site_stats(profile, site)->died += 1;
+}
+
+// Reporting
+
+static double survival_rate(const site_stats_t* s) {
+  uint64_t collected = s->survived + s->died;
+  return collected == 0 ? 0.0 : (double)s->survived / (double)collected;
+}
+
+/* The sort functions compare pointers to the sites' statistics */
+static int compare_bytes(const void* a, const void* b) {
+  const site_stats_t* sa = *(const site_stats_t* const*)a;
+  const site_stats_t* sb = *(const site_stats_t* const*)b;
+  return (sa->bytes < sb->bytes) - (sa->bytes > sb->bytes);
+}
+
+static int compare_survival(const void* a, const void* b) {
+  const site_stats_t* sa = *(const site_stats_t* const*)a;
+  const site_stats_t* sb = *(const site_stats_t* const*)b;
+  double ra = survival_rate(sa), rb = survival_rate(sb);
+  if (ra != rb)
+    return (ra < rb) - (ra > rb);
+  return compare_bytes(a, b);
+}
+
+static void print_site(FILE* out, const alloc_profile_t* profile,
+                       const site_stats_t* s) {
+  uvalue_t index = (uvalue_t)(s - profile->sites);
+  /* line is the 1-based line of the instruction in the .asm file */
+  fprintf(out, "  %08x (line %6u) %12llu bytes %10llu objects"
+          " %10llu survived %10llu died %6.1f%%\n",
+          (uvalue_t)(index * sizeof(instr_t)), index + 1,
+          (unsigned long long)s->bytes, (unsigned long long)s->objects,
+          (unsigned long long)s->survived, (unsigned long long)s->died,
+          100.0 * survival_rate(s));
+}
+
+void alloc_profile_report(const alloc_profile_t* profile, FILE* out,
+                          size_t top_n) {
+  const site_stats_t** order =
+    malloc((profile->site_count + 1) * sizeof(site_stats_t*));
+  if (order == NULL)
+    fail("cannot allocate allocation profile report");
+
+  size_t active = 0;
+  uint64_t total_bytes = 0, total_objects = 0;
+  for (uvalue_t i = 0; i < profile->site_count; ++i) {
+    const site_stats_t* s = &profile->sites[i];
+    if (s->objects > 0) {
+      order[active++] = s;
+      total_bytes += s->bytes;
+      total_objects += s->objects;
+    }
+  }
+  size_t shown = active < top_n ? active : top_n;
+
+  fprintf(out, "\nAllocation profile: %zu sites, %llu bytes, %llu objects\n",
+          active, (unsigned long long)total_bytes,
+          (unsigned long long)total_objects);
+
+  qsort(order, active, sizeof(site_stats_t*), compare_bytes);
+  fprintf(out, "Top %zu sites by allocated bytes:\n", shown);
+  for (size_t i = 0; i < shown; ++i)
+    print_site(out, profile, order[i]);
+
+  /* only sites whose blocks have been through a collection have a rate */
+  size_t collected = 0;
+  for (size_t i = 0; i < active; ++i) {
+    if (order[i]->survived + order[i]->died > 0)
+      order[collected++] = order[i];
+  }
+  shown = collected < top_n ? collected : top_n;
+
+  qsort(order, collected, sizeof(site_stats_t*), compare_survival);
+  fprintf(out, "Top %zu sites by survival rate:\n", shown);
+  for (size_t i = 0; i < shown; ++i)
+    print_site(out, profile, order[i]);
+
+  free(order);
+}
@@ -0,0 +1,37 @@
+#ifndef ALLOC_PROFILE_H
+#define ALLOC_PROFILE_H
+
+#include <stdio.h>
+#include "vmtypes.h"
+
+/* Allocation-site profiling (enabled by building with -DALLOC_PROFILE).
+ * A site is identified by the virtual address of the RALO/BALO
+ * instruction that performed the allocation. Each VM has its own
+ * profile. */
+
+typedef struct alloc_profile alloc_profile_t;
+
+/* Setup the per-site tables for a code area of code_size bytes */
+alloc_profile_t* alloc_profile_setup(uvalue_t code_size);
+
+/* Forget all the allocations recorded so far */
+void alloc_profile_reset(alloc_profile_t* profile);
+
+/* Release the per-site tables */
+void alloc_profile_cleanup(alloc_profile_t* profile);
+
+/* Record the allocation of a block of total_words words (header included) */
+void alloc_profile_allocated(alloc_profile_t* profile, uvalue_t site,
+                             uvalue_t total_words);
+
+/* Record that a block allocated at site survived a collection */
+void alloc_profile_survived(alloc_profile_t* profile, uvalue_t site);
+
+/* Record that a block allocated at site was freed by a collection */
+void alloc_profile_died(alloc_profile_t* profile, uvalue_t site);
+
+/* Print the top_n sites by allocated bytes and by survival rate */
+void alloc_profile_report(const alloc_profile_t* profile, FILE* out,
+                          size_t top_n);
+
+#endif // ALLOC_PROFILE_H
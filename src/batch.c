@@ -0,0 +1,360 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <errno.h>
+
+#include "batch.h"
+#include "program.h"
+#include "optimizer.h"
+#include "engine.h"
+#include "timer.h"
+#include "io.h"
+#include "fail.h"
+
+/* Marking is recursive: give the workers a stack as large as the one of
+   the main thread usually is */
+#define WORKER_STACK_SIZE (64 * 1024 * 1024)
+
+#define JOB_SEPARATORS " \t\r\n"
+
+typedef struct {
+  const batch_options_t* options;
+  char* file_name;
+  char* input_file_name;
+  char* output_file_name;
+  vm_context_t vm;
+  int in_fd;
+  int out_fd;
+  engine_status_t status;       /* of the last resume, with a quantum */
+  bool parked;                  /* waiting for input, with a quantum */
+  bool failed;
+  uvalue_t halt_code;
+  double start;
+  double seconds;
+} job_t;
+
+/* The jobs shared by the workers, each taking the next one to run */
+typedef struct {
+  const batch_options_t* options;
+  job_t* jobs;
+  size_t job_count;
+  _Atomic size_t next_job;
+  unsigned int thread_count;
+} pool_t;
+
+typedef struct {
+  pool_t* pool;
+  unsigned int index;
+} worker_t;
+
+// Jobs file
+
+static char* copy_string(const char* string) {
+  char* copy = strdup(string);
+  if (copy == NULL)
+    fail("cannot allocate jobs");
+  return copy;
+}
+
+static job_t* read_jobs(const batch_options_t* options, size_t* job_count) {
+  FILE* file = fopen(options->jobs_file_name, "r");
+  if (file == NULL)
+    fail("cannot open jobs file %s", options->jobs_file_name);
+
+  job_t* jobs = NULL;
+  size_t count = 0, capacity = 0;
+  char* line = NULL;
+  size_t line_size = 0;
+  unsigned int line_number = 0;
+  while (getline(&line, &line_size, file) >= 0) {
+    line_number += 1;
+
+    char* fields[4];
+    unsigned int field_count = 0;
+    char* save = NULL;
+    for (char* field = strtok_r(line, JOB_SEPARATORS, &save);
+         field != NULL && field_count < 4;
+         field = strtok_r(NULL, JOB_SEPARATORS, &save))
+      fields[field_count++] = field;
+
+    if (field_count == 0 || fields[0][0] == '#')
+      continue;
+    if (field_count < 2 || field_count > 3)
+      fail("%s:%u: invalid job", options->jobs_file_name, line_number);
+    if (field_count == 2 && options->file_name == NULL)
+      fail("%s:%u: no assembly file given", options->jobs_file_name,
+           line_number);
+
+    if (count == capacity) {
+      capacity = capacity == 0 ? 16 : 2 * capacity;
+      jobs = realloc(jobs, capacity * sizeof(job_t));
+      if (jobs == NULL)
+        fail("cannot allocate jobs");
+    }
+    job_t* job = &jobs[count++];
+    memset(job, 0, sizeof(job_t));
+    job->options = options;
+    char** names = fields + field_count - 2;
+    job->file_name =
+      copy_string(field_count == 3 ? fields[0] : options->file_name);
+    job->input_file_name = copy_string(names[0]);
+    job->output_file_name = copy_string(names[1]);
+    job->in_fd = job->out_fd = -1;
+  }
+  free(line);
+  fclose(file);
+
+  *job_count = count;
+  return jobs;
+}
+
+// Running jobs
+
+/* Open the input of the job. With a quantum, a job waiting for input
+   must yield instead of blocking, so the input is made non-blocking; a
+   FIFO is opened without waiting for a writer, and the job is parked
+   until one shows up, since reading it before would return end of
+   file */
+static int open_input(job_t* job) {
+  struct stat status;
+  bool fifo = job->options->quantum > 0
+    && stat(job->input_file_name, &status) == 0 && S_ISFIFO(status.st_mode);
+  int fd = open(job->input_file_name, fifo ? O_RDONLY | O_NONBLOCK : O_RDONLY);
+  if (fd < 0)
+    fail("cannot open input file %s", job->input_file_name);
+  if (job->options->quantum > 0 && !fifo) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+      close(fd);
+      fail("cannot make input file %s non-blocking", job->input_file_name);
+    }
+  }
+  /* poll reports a FIFO readable once a writer has written to it or
+     closed it, not before */
+  job->parked = fifo;
+  return fd;
+}
+
+/* Open the files and load the program */
+static void start_job(void* arg) {
+  job_t* job = arg;
+  const batch_options_t* options = job->options;
+  /* nothing of this job to flush yet, nor of the previous one */
+  fail_set_cleanup(NULL, NULL);
+  job->in_fd = open_input(job);
+  job->out_fd = open(job->output_file_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (job->out_fd < 0)
+    fail("cannot open output file %s", job->output_file_name);
+
+  program_load(&job->vm, job->file_name, options->memory_size);
+  if (options->optimize) {
+    optimizer_stats_t optimizer_stats;
+    optimizer_run(&job->vm, &optimizer_stats);
+  }
+  job->vm.io = io_setup(job->in_fd, job->out_fd, options->writer_thread);
+  io_flush_on_fail(job->vm.io);
+  if (options->quantum > 0)
+    engine_start(&job->vm);
+}
+
+/* Run the program until it halts */
+static void run_job(void* arg) {
+  job_t* job = arg;
+  job->halt_code = engine_run(&job->vm);
+}
+
+/* Run the program for a quantum; the jobs of a thread take turns, so a
+   failure must flush the output of this one */
+static void resume_job(void* arg) {
+  job_t* job = arg;
+  io_flush_on_fail(job->vm.io);
+  job->status = engine_resume(&job->vm, job->options->quantum);
+  if (job->status == engine_HALTED)
+    job->halt_code = job->vm.halt_code;
+}
+
+/* Release what start_job got, even if it failed */
+static void finish_job(void* arg) {
+  job_t* job = arg;
+  if (job->vm.io != NULL) {
+    io_t* io = job->vm.io;
+    job->vm.io = NULL;
+    io_cleanup(io);
+  }
+  if (job->vm.memory != NULL)
+    program_unload(&job->vm);
+  if (job->in_fd >= 0)
+    close(job->in_fd);
+  if (job->out_fd >= 0 && close(job->out_fd) != 0)
+    fail("cannot write output file %s", job->output_file_name);
+  job->in_fd = job->out_fd = -1;
+}
+
+/* Release the job, which succeeded if ok */
+static void end_job(job_t* job, bool ok) {
+  bool finished = fail_try(finish_job, job);
+  job->failed = !ok || !finished;
+  job->seconds = timer_now() - job->start;
+}
+
+/* Run the jobs first, first + stride... as green threads */
+static void run_green_threads(pool_t* pool, size_t first, size_t stride) {
+  size_t capacity = (pool->job_count - first + stride - 1) / stride;
+  job_t** active = malloc(capacity * sizeof(job_t*));
+  struct pollfd* poll_fds = malloc(capacity * sizeof(struct pollfd));
+  if (active == NULL || poll_fds == NULL)
+    fail("cannot allocate green threads");
+
+  size_t active_count = 0;
+  for (size_t i = first; i < pool->job_count; i += stride) {
+    job_t* job = &pool->jobs[i];
+    job->start = timer_now();
+    if (fail_try(start_job, job))
+      active[active_count++] = job;
+    else
+      end_job(job, false);
+  }
+
+  while (active_count > 0) {
+    /* resume every runnable job once, removing the ones that ended */
+    size_t runnable_count = 0;
+    for (size_t a = 0; a < active_count;) {
+      job_t* job = active[a];
+      if (!job->parked) {
+        bool ok = fail_try(resume_job, job);
+        if (!ok || job->status == engine_HALTED) {
+          end_job(job, ok);
+          active[a] = active[--active_count];
+          continue;
+        }
+        job->parked = job->status == engine_BLOCKED;
+      }
+      runnable_count += job->parked ? 0 : 1;
+      a += 1;
+    }
+    if (runnable_count == active_count)
+      continue;
+
+    /* unpark the jobs whose input is readable, waiting for one of them
+       if no job can run */
+    size_t parked_count = 0;
+    for (size_t a = 0; a < active_count; ++a) {
+      if (active[a]->parked)
+        poll_fds[parked_count++] =
+          (struct pollfd){ active[a]->in_fd, POLLIN, 0 };
+    }
+    int ready = poll(poll_fds, parked_count, runnable_count > 0 ? 0 : -1);
+    if (ready < 0 && errno != EINTR)
+      fail("cannot wait for input");
+    for (size_t a = 0, p = 0; ready > 0 && a < active_count; ++a) {
+      if (active[a]->parked)
+        active[a]->parked = poll_fds[p++].revents == 0;
+    }
+  }
+
+  free(poll_fds);
+  free(active);
+}
+
+static void* worker_main(void* arg) {
+  worker_t* worker = arg;
+  pool_t* pool = worker->pool;
+  if (pool->options->quantum > 0) {
+    run_green_threads(pool, worker->index, pool->thread_count);
+    return NULL;
+  }
+
+  for (;;) {
+    size_t index = atomic_fetch_add(&pool->next_job, 1);
+    if (index >= pool->job_count)
+      break;
+
+    job_t* job = &pool->jobs[index];
+    job->start = timer_now();
+    bool ok = fail_try(start_job, job) && fail_try(run_job, job);
+    end_job(job, ok);
+  }
+  return NULL;
+}
+
+// Report
+
+static unsigned int report(FILE* out, const pool_t* pool,
+                           unsigned int thread_count, double elapsed) {
+  unsigned int failed_count = 0;
+  double job_seconds = 0.0;
+  for (size_t i = 0; i < pool->job_count; ++i) {
+    const job_t* job = &pool->jobs[i];
+    fprintf(out, "%s < %s > %s: ", job->file_name, job->input_file_name,
+            job->output_file_name);
+    if (job->failed)
+      fprintf(out, "failed\n");
+    else
+      fprintf(out, "halted with %u in %.3f s\n", job->halt_code, job->seconds);
+    failed_count += job->failed ? 1 : 0;
+    job_seconds += job->seconds;
+  }
+
+  fprintf(out, "%zu jobs, %u failed, %u threads: %.3f s elapsed,"
+          " %.3f s in jobs, %.2f jobs/s\n",
+          pool->job_count, failed_count, thread_count, elapsed, job_seconds,
+          elapsed > 0.0 ? (double)pool->job_count / elapsed : 0.0);
+  fflush(out);
+  return failed_count;
+}
+
+unsigned int batch_run(const batch_options_t* options) {
+  pool_t pool;
+  pool.options = options;
+  pool.jobs = read_jobs(options, &pool.job_count);
+  atomic_init(&pool.next_job, 0);
+
+  unsigned int thread_count = options->threads;
+  if (thread_count == 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    thread_count = online > 0 ? (unsigned int)online : 1;
+  }
+  if (thread_count > pool.job_count)
+    thread_count = pool.job_count > 0 ? (unsigned int)pool.job_count : 1;
+
+  pool.thread_count = thread_count;
+
+  pthread_t* threads = malloc(thread_count * sizeof(pthread_t));
+  worker_t* workers = malloc(thread_count * sizeof(worker_t));
+  if (threads == NULL || workers == NULL)
+    fail("cannot allocate thread pool");
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, WORKER_STACK_SIZE);
+
+  double start = timer_now();
+  for (unsigned int t = 0; t < thread_count; ++t) {
+    workers[t] = (worker_t){ &pool, t };
+    if (pthread_create(&threads[t], &attr, worker_main, &workers[t]) != 0)
+      fail("cannot start worker thread");
+  }
+  for (unsigned int t = 0; t < thread_count; ++t)
+    pthread_join(threads[t], NULL);
+  double elapsed = timer_now() - start;
+  pthread_attr_destroy(&attr);
+  free(workers);
+  free(threads);
+
+  unsigned int failed_count = report(stdout, &pool, thread_count, elapsed);
+
+  for (size_t i = 0; i < pool.job_count; ++i) {
+    free(pool.jobs[i].file_name);
+    free(pool.jobs[i].input_file_name);
+    free(pool.jobs[i].output_file_name);
+  }
+  free(pool.jobs);
+  return failed_count;
+}
@@ -0,0 +1,35 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct {
+  char* jobs_file_name;         /* list of the jobs to run */
+  char* file_name;              /* assembly file of the jobs that give none */
+  size_t memory_size;           /* memory of each job */
+  unsigned int threads;         /* size of the thread pool */
+  uint64_t quantum;             /* green threads time slice, 0 for none */
+  bool optimize;                /* run the optimizer after loading */
+  bool writer_thread;           /* give each job a writer thread */
+} batch_options_t;
+
+/* Run the jobs listed in the jobs file on a pool of threads, each job in
+ * its own VM, then print the result of each job and the throughput on
+ * the standard output. Each line of the jobs file is
+ *
+ *   [<asm_file>] <input_file> <output_file>
+ *
+ * Empty lines and lines starting with # are ignored. A job that fails
+ * does not stop the others; return the number of jobs that failed.
+ *
+ * Without a quantum, each thread runs one job at a time to completion.
+ * With a quantum, the jobs are divided among the threads, and each
+ * thread runs all its jobs as green threads: it resumes them in turn,
+ * each one for quantum backward jumps or calls. A job waiting for input
+ * is parked until its input is readable, so that it does not block the
+ * others. */
+unsigned int batch_run(const batch_options_t* options);
+
+#endif // BATCH_H
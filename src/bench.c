@@ -0,0 +1,188 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "program.h"
+#include "optimizer.h"
+#include "engine.h"
+#include "memory.h"
+#include "timer.h"
+#include "io.h"
+#include "fail.h"
+
+typedef struct {
+  double load;                  /* parsing and loading the code */
+  double execution;             /* engine_run, collections included */
+  double gc;                    /* collections only */
+  uvalue_t gc_count;
+  size_t live_bytes;            /* heap in use after the last collection */
+} sample_t;
+
+// Statistics
+
+/* Two-sided 95% quantiles of Student's t distribution, by degrees of
+   freedom; the normal quantile is used above 30 */
+static const double t_quantiles[] = {
+  0.0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262,
+  2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093,
+  2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045,
+  2.042
+};
+
+static int compare_doubles(const void* a, const void* b) {
+  double da = *(const double*)a, db = *(const double*)b;
+  return (da > db) - (da < db);
+}
+
+static void write_stats(FILE* out, const char* name, const double* values,
+                        unsigned int n) {
+  double* sorted = malloc(n * sizeof(double));
+  if (sorted == NULL)
+    fail("cannot allocate benchmark statistics");
+  memcpy(sorted, values, n * sizeof(double));
+  qsort(sorted, n, sizeof(double), compare_doubles);
+
+  double sum = 0.0;
+  for (unsigned int i = 0; i < n; ++i)
+    sum += values[i];
+  double mean = sum / n;
+
+  double squares = 0.0;
+  for (unsigned int i = 0; i < n; ++i)
+    squares += (values[i] - mean) * (values[i] - mean);
+  double stddev = n > 1 ? sqrt(squares / (n - 1)) : 0.0;
+
+  double median = n % 2 == 1
+    ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2.0;
+  unsigned int p99_rank = (unsigned int)ceil(0.99 * n);
+  double p99 = sorted[p99_rank > 0 ? p99_rank - 1 : 0];
+
+  unsigned int df = n > 1 ? n - 1 : 1;
+  double t = df < sizeof(t_quantiles) / sizeof(t_quantiles[0])
+    ? t_quantiles[df] : 1.960;
+  double half_width = n > 1 ? t * stddev / sqrt(n) : 0.0;
+
+  fprintf(out, "  \"%s\": {\"mean\": %.9f, \"median\": %.9f, \"p99\": %.9f, "
+          "\"stddev\": %.9f, \"ci95\": [%.9f, %.9f], \"min\": %.9f, "
+          "\"max\": %.9f,\n    \"samples\": [",
+          name, mean, median, p99, stddev, mean - half_width,
+          mean + half_width, sorted[0], sorted[n - 1]);
+  for (unsigned int i = 0; i < n; ++i)
+    fprintf(out, "%s%.9f", i == 0 ? "" : ", ", values[i]);
+  fprintf(out, "]}");
+
+  free(sorted);
+}
+
+static void write_json_string(FILE* out, const char* string) {
+  fputc('"', out);
+  for (const char* c = string; c != NULL && *c != '\0'; ++c) {
+    if (*c == '"' || *c == '\\')
+      fputc('\\', out);
+    fputc(*c, out);
+  }
+  fputc('"', out);
+}
+
+// Runs
+
+static int open_input(const char* input_file_name) {
+  const char* name = input_file_name != NULL ? input_file_name : "/dev/null";
+  int fd = open(name, O_RDONLY);
+  if (fd < 0)
+    fail("cannot open input file %s", name);
+  return fd;
+}
+
+static sample_t run_once(const bench_options_t* options, int out_fd) {
+  sample_t sample;
+  vm_context_t vm = { 0 };
+  int in_fd = open_input(options->input_file_name);
+
+  double start = timer_now();
+  program_load(&vm, options->file_name, options->memory_size);
+  if (options->optimize) {
+    optimizer_stats_t optimizer_stats;
+    optimizer_run(&vm, &optimizer_stats);
+  }
+  double loaded = timer_now();
+  vm.io = io_setup(in_fd, out_fd, false);
+  io_flush_on_fail(vm.io);
+  engine_run(&vm);
+  io_cleanup(vm.io);
+  double finished = timer_now();
+  close(in_fd);
+
+  memory_stats_t stats;
+  memory_get_stats(&vm, &stats);
+  program_unload(&vm);
+
+  sample.load = loaded - start;
+  sample.execution = finished - loaded;
+  sample.gc = stats.gc_seconds;
+  sample.gc_count = stats.gc_count;
+  sample.live_bytes = stats.live_bytes;
+  return sample;
+}
+
+void bench_run(const bench_options_t* options) {
+  unsigned int n = options->runs;
+  double* values = malloc(3 * n * sizeof(double));
+  if (values == NULL)
+    fail("cannot allocate benchmark samples");
+  double* load = values;
+  double* execution = values + n;
+  double* gc = values + 2 * n;
+
+  /* the program's output goes to /dev/null, the report to stdout */
+  int null_fd = open("/dev/null", O_WRONLY);
+  if (null_fd < 0)
+    fail("cannot open /dev/null");
+
+  for (unsigned int i = 0; i < options->warmup_runs; ++i)
+    run_once(options, null_fd);
+
+  uvalue_t gc_count = 0;
+  size_t live_bytes = 0;
+  for (unsigned int i = 0; i < n; ++i) {
+    sample_t sample = run_once(options, null_fd);
+    load[i] = sample.load;
+    execution[i] = sample.execution;
+    gc[i] = sample.gc;
+    gc_count = sample.gc_count;
+    live_bytes = sample.live_bytes;
+  }
+
+  close(null_fd);
+
+  FILE* out = stdout;
+  fprintf(out, "{\n  \"program\": ");
+  write_json_string(out, options->file_name);
+  fprintf(out, ",\n  \"input\": ");
+  if (options->input_file_name != NULL)
+    write_json_string(out, options->input_file_name);
+  else
+    fprintf(out, "null");
+  fprintf(out, ",\n  \"memory_module\": ");
+  write_json_string(out, memory_get_identity());
+  fprintf(out, ",\n  \"memory_size\": %zu,\n  \"runs\": %u,\n"
+          "  \"warmup_runs\": %u,\n  \"optimized\": %s,\n"
+          "  \"gc_count\": %u,\n  \"live_bytes\": %zu,\n",
+          options->memory_size, n, options->warmup_runs,
+          options->optimize ? "true" : "false", gc_count, live_bytes);
+  write_stats(out, "load", load, n);
+  fprintf(out, ",\n");
+  write_stats(out, "execution", execution, n);
+  fprintf(out, ",\n");
+  write_stats(out, "gc", gc, n);
+  fprintf(out, "\n}\n");
+  fflush(out);
+
+  free(values);
+}
@@ -0,0 +1,22 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef struct {
+  char* file_name;              /* assembly file to run */
+  char* input_file_name;        /* recorded standard input, or NULL */
+  size_t memory_size;
+  unsigned int runs;            /* measured runs */
+  unsigned int warmup_runs;     /* runs done before measuring */
+  bool optimize;                /* run the optimizer after loading */
+} bench_options_t;
+
+/* Run the program several times in-process, with its standard input
+ * read from the recorded input file and its output discarded, then
+ * write the load, execution and GC time statistics on the standard
+ * output as JSON */
+void bench_run(const bench_options_t* options);
+
+#endif // BENCH_H
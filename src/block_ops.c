@@ -0,0 +1,97 @@
+#include <string.h>
+
+#include "block_ops.h"
+
+/* A vector of words, as wide as the widest vector registers of the
+   target (with -march=native); unaligned accesses go through memcpy */
+#if defined(__AVX512F__)
+#define VECTOR_BYTES 64
+#elif defined(__AVX__)
+#define VECTOR_BYTES 32
+#else
+#define VECTOR_BYTES 16
+#endif
+
+typedef uvalue_t vector_t __attribute__ ((vector_size(VECTOR_BYTES)));
+
+#define VECTOR_WORDS (VECTOR_BYTES / sizeof(uvalue_t))
+
+static inline vector_t vector_load(const uvalue_t* src) {
+  vector_t v;
+  memcpy(&v, src, sizeof(v));
+  return v;
+}
+
+static inline void vector_store(uvalue_t* dst, vector_t v) {
+  memcpy(dst, &v, sizeof(v));
+}
+
+void block_copy(uvalue_t* dst, const uvalue_t* src, size_t count) {
+  if (dst == src || count == 0)
+    return;
+
+  size_t i = 0;
+  if (dst < src || dst >= src + count) {
+    /* forward: a vector is loaded before any write can reach it */
+    for (; i + 2 * VECTOR_WORDS <= count; i += 2 * VECTOR_WORDS) {
+      vector_t v0 = vector_load(src + i);
+      vector_t v1 = vector_load(src + i + VECTOR_WORDS);
+      vector_store(dst + i, v0);
+      vector_store(dst + i + VECTOR_WORDS, v1);
+    }
+    for (; i + VECTOR_WORDS <= count; i += VECTOR_WORDS)
+      vector_store(dst + i, vector_load(src + i));
+    for (; i < count; ++i)
+      dst[i] = src[i];
+  } else {
+    /* backward, dst overlaps the end of src */
+    size_t n = count;
+    for (; n >= VECTOR_WORDS; n -= VECTOR_WORDS)
+      vector_store(dst + n - VECTOR_WORDS, vector_load(src + n - VECTOR_WORDS));
+    while (n > 0) {
+      n -= 1;
+      dst[n] = src[n];
+    }
+  }
+}
+
+void block_fill(uvalue_t* dst, uvalue_t value, size_t count) {
+  vector_t v;
+  for (size_t k = 0; k < VECTOR_WORDS; ++k)
+    v[k] = value;
+
+  size_t i = 0;
+  for (; i + 2 * VECTOR_WORDS <= count; i += 2 * VECTOR_WORDS) {
+    vector_store(dst + i, v);
+    vector_store(dst + i + VECTOR_WORDS, v);
+  }
+  for (; i + VECTOR_WORDS <= count; i += VECTOR_WORDS)
+    vector_store(dst + i, v);
+  for (; i < count; ++i)
+    dst[i] = value;
+}
+
+int block_compare(const uvalue_t* a, size_t a_count,
+                  const uvalue_t* b, size_t b_count) {
+  size_t count = a_count < b_count ? a_count : b_count;
+  size_t i = 0;
+
+  /* skip the equal prefix four vectors at a time, the reduction of the
+     differences to a scalar being the expensive part */
+  for (; i + 4 * VECTOR_WORDS <= count; i += 4 * VECTOR_WORDS) {
+    vector_t diff = vector_load(a + i) ^ vector_load(b + i);
+    for (size_t v = 1; v < 4; ++v)
+      diff |= vector_load(a + i + v * VECTOR_WORDS)
+        ^ vector_load(b + i + v * VECTOR_WORDS);
+    uvalue_t any = 0;
+    for (size_t k = 0; k < VECTOR_WORDS; ++k)
+      any |= diff[k];
+    if (any != 0)
+      break;
+  }
+  for (; i < count; ++i) {
+    if (a[i] != b[i])
+      return a[i] < b[i] ? -1 : 1;
+  }
+  return (a_count > b_count) - (a_count < b_count);
+}
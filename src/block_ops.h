@@ -0,0 +1,21 @@
+#ifndef BLOCK_OPS_H
+#define BLOCK_OPS_H
+
+#include <stddef.h>
+#include "vmtypes.h"
+
+/* Vectorized kernels for the block instructions BCPY, BFIL and BCMP */
+
+/* Copy count words from src to dst, which may overlap (like memmove) */
+void block_copy(uvalue_t* dst, const uvalue_t* src, size_t count);
+
+/* Set count words of dst to value */
+void block_fill(uvalue_t* dst, uvalue_t value, size_t count);
+
+/* Compare two blocks lexicographically, as unsigned words, a shorter
+ * block being smaller than a longer one it is a prefix of; return -1, 0
+ * or 1 */
+int block_compare(const uvalue_t* a, size_t a_count,
+                  const uvalue_t* b, size_t b_count);
+
+#endif // BLOCK_OPS_H
@@ -1,60 +1,87 @@
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "vmtypes.h"
 #include "engine.h"
 #include "opcode.h"
 #include "memory.h"
 #include "fail.h"
+#include "io.h"
+#include "block_ops.h"
 
 typedef enum {
   Lb, Lb1, Lb2, Lb3, Lb4, Lb5,
   Ib, Ob
 } reg_bank_t;
 
-static void* memory_start;
-static void* memory_end;
-
-static uvalue_t* R[8];          /* (pseudo)base registers */
-
-void engine_setup(void) {
-  memory_start = memory_get_start();
-  memory_end = memory_get_end();
+void engine_setup(vm_context_t* vm) {
+  vm->memory_start = memory_get_start(vm);
+  vm->memory_end = memory_get_end(vm);
+#ifdef GC_STATS
+  vm->instr_count = vm->instr_saved = 0;
+  vm->saved_at = vm->saved_if_taken = NULL;
+#endif
 }
 
-void engine_cleanup(void) {
-  // nothing to do
+void engine_cleanup(vm_context_t* vm) {
+#ifdef GC_STATS
+  fprintf(stderr, "\nINSTRUCTION COUNT = %llu\n",
+          (unsigned long long)vm->instr_count);
+  if (vm->saved_at != NULL) {
+    fprintf(stderr, "INSTRUCTIONS SAVED BY THE OPTIMIZER = %llu\n",
+            (unsigned long long)vm->instr_saved);
+    free(vm->saved_at);
+    free(vm->saved_if_taken);
+    vm->saved_at = vm->saved_if_taken = NULL;
+  }
+#endif
+  vm->memory_start = vm->memory_end = NULL;
 }
 
-void engine_emit(instr_t instr, instr_t** instr_ptr) {
-  if ((void*)(*instr_ptr + 1) > memory_end)
+void engine_emit(vm_context_t* vm, instr_t instr, instr_t** instr_ptr) {
+  if ((void*)(*instr_ptr + 1) > vm->memory_end)
     fail("not enough memory to load code");
   **instr_ptr = instr;
   *instr_ptr += 1;
 }
 
-uvalue_t* engine_get_Lb(void) { return R[Lb]; }
-uvalue_t* engine_get_Ib(void) { return R[Ib]; }
-uvalue_t* engine_get_Ob(void) { return R[Ob]; }
+uvalue_t* engine_get_Lb(vm_context_t* vm) { return vm->R[Lb]; }
+uvalue_t* engine_get_Ib(vm_context_t* vm) { return vm->R[Ib]; }
+uvalue_t* engine_get_Ob(vm_context_t* vm) { return vm->R[Ob]; }
 
-void engine_set_Lb(uvalue_t* new_value) {
+void engine_set_Lb(vm_context_t* vm, uvalue_t* new_value) {
   for (reg_bank_t pseudo_bank = Lb; pseudo_bank <= Lb5; ++pseudo_bank)
-    R[pseudo_bank] = new_value + (pseudo_bank - Lb) * 32;
+    vm->R[pseudo_bank] = new_value + (pseudo_bank - Lb) * 32;
+}
+void engine_set_Ib(vm_context_t* vm, uvalue_t* new_value) {
+  vm->R[Ib] = new_value;
+}
+void engine_set_Ob(vm_context_t* vm, uvalue_t* new_value) {
+  vm->R[Ob] = new_value;
 }
-void engine_set_Ib(uvalue_t* new_value) { R[Ib] = new_value; }
-void engine_set_Ob(uvalue_t* new_value) { R[Ob] = new_value; }
 
 // Virtual <-> physical address translation
 
-static void* addr_v_to_p(uvalue_t v_addr) {
+static void* addr_v_to_p(void* memory_start, uvalue_t v_addr) {
   return (char*)memory_start + v_addr;
 }
 
-static uvalue_t addr_p_to_v(void* p_addr) {
-  assert(memory_start <= p_addr && p_addr <= memory_end);
-  return (uvalue_t)((char*)p_addr - (char*)memory_start);
+static uvalue_t addr_p_to_v(const vm_context_t* vm, void* p_addr) {
+  assert(vm->memory_start <= p_addr && p_addr <= vm->memory_end);
+  return (uvalue_t)((char*)p_addr - (char*)vm->memory_start);
 }
 
+#ifdef ALLOC_PROFILE
+uvalue_t engine_get_alloc_site(vm_context_t* vm) {
+  return addr_p_to_v(vm, vm->alloc_site);
+}
+
+#define RECORD_ALLOC_SITE() (vm->alloc_site = pc)
+#else
+#define RECORD_ALLOC_SITE()
+#endif
+
 // Instruction decoding
 
 static reg_bank_t reg_bank(reg_id_t r) {
@@ -96,19 +123,100 @@ static int instr_d(instr_t instr) {
   return instr_extract_s(instr, 0, 10);
 }
 
+static byte_format_t instr_byte_format(instr_t instr) {
+  unsigned int format = instr_extract_u(instr, 0, 2);
+  if (format >= BYTE_FORMAT_COUNT)
+    fail("invalid byte format %u", format);
+  return (byte_format_t)format;
+}
+
 // (Pseudo-)register access
 
+#define R (vm->R)
+
 #define Ra (R[reg_bank(instr_ra(*pc))][reg_index(instr_ra(*pc))])
 #define Rb (R[reg_bank(instr_rb(*pc))][reg_index(instr_rb(*pc))])
 #define Rc (R[reg_bank(instr_rc(*pc))][reg_index(instr_rc(*pc))])
 
+/* Registers of the extension word of two-word instructions */
+#define Rd (R[reg_bank(instr_ra(pc[1]))][reg_index(instr_ra(pc[1]))])
+#define Re (R[reg_bank(instr_rb(pc[1]))][reg_index(instr_rb(pc[1]))])
+
+#ifdef GC_STATS
+#define GOTO_NEXT                                                       \
+  vm->instr_count += 1;                                                 \
+  if (vm->saved_at != NULL && pc < vm->code_end)                        \
+    vm->instr_saved += vm->saved_at[pc - (instr_t*)memory_start];       \
+  goto *labels[instr_opcode(*pc)]
+/* Displacement d of a taken conditional jump */
+#define TAKEN(d)                                                        \
+  ((vm->saved_if_taken != NULL                                          \
+    ? vm->instr_saved += vm->saved_if_taken[pc - (instr_t*)memory_start] \
+    : 0), (d))
+#else
 #define GOTO_NEXT goto *labels[instr_opcode(*pc)]
+#define TAKEN(d) (d)
+#endif
+
+// Block range checking
+
+static void check_block_range(uvalue_t* block, uvalue_t start, uvalue_t count) {
+  uvalue_t size = memory_get_block_size(block);
+  if (start > size || count > size - start)
+    fail("access to words %u to %u of a block of size %u",
+         start, start + count, size);
+}
+
+// Suspension
+
+/* Count a backward jump or call, yield once the budget is exhausted */
+#define CHECK_BUDGET()                          \
+  if (--budget == 0) {                          \
+    vm->pc = pc;                                \
+    return engine_YIELDED;                      \
+  }
+
+/* Yield before the current instruction, to execute it again later */
+#define BLOCK()                                 \
+  {                                             \
+    vm->pc = pc;                                \
+    return engine_BLOCKED;                      \
+  }
+
+void engine_start(vm_context_t* vm) {
+  vm->pc = vm->memory_start;
+  engine_set_Lb(vm, vm->memory_start);
+  engine_set_Ib(vm, vm->memory_start);
+  engine_set_Ob(vm, vm->memory_start);
+#ifdef GC_STATS
+  /* like the GC counters, reset by memory_reset when a server reuses the
+     VM, count the current run only */
+  vm->instr_count = vm->instr_saved = 0;
+#endif
+}
+
+uvalue_t engine_continue(vm_context_t* vm) {
+  for (;;) {
+    switch (engine_resume(vm, UINT64_MAX)) {
+    case engine_HALTED:
+      return vm->halt_code;
+    case engine_BLOCKED:
+      io_wait_input(vm->io);
+      break;
+    case engine_YIELDED:
+      break;
+    }
+  }
+}
 
-uvalue_t engine_run() {
-  instr_t* pc = memory_start;
-  engine_set_Lb(memory_start);
-  engine_set_Ib(memory_start);
-  engine_set_Ob(memory_start);
+uvalue_t engine_run(vm_context_t* vm) {
+  engine_start(vm);
+  return engine_continue(vm);
+}
+
+engine_status_t engine_resume(vm_context_t* vm, uint64_t budget) {
+  void* const memory_start = vm->memory_start;
+  instr_t* pc = vm->pc;
 
   void** labels[OPCODE_COUNT];
   labels[opcode_ADD] = &&l_ADD;
@@ -139,8 +247,13 @@ uvalue_t engine_run() {
   labels[opcode_BTAG] = &&l_BTAG;
   labels[opcode_BGET] = &&l_BGET;
   labels[opcode_BSET] = &&l_BSET;
+  labels[opcode_BCPY] = &&l_BCPY;
+  labels[opcode_BFIL] = &&l_BFIL;
+  labels[opcode_BCMP] = &&l_BCMP;
   labels[opcode_BREA] = &&l_BREA;
   labels[opcode_BWRI] = &&l_BWRI;
+  labels[opcode_BRDB] = &&l_BRDB;
+  labels[opcode_BWRB] = &&l_BWRB;
 
   GOTO_NEXT;
 
@@ -195,61 +308,81 @@ uvalue_t engine_run() {
   } GOTO_NEXT;
 
  l_JLT: {
-    pc += ((value_t)Ra < (value_t)Rb ? instr_d(*pc) : 1);
+    int d = (value_t)Ra < (value_t)Rb ? TAKEN(instr_d(*pc)) : 1;
+    pc += d;
+    if (d <= 0)
+      CHECK_BUDGET();
   } GOTO_NEXT;
 
  l_JLE: {
-    pc += ((value_t)Ra <= (value_t)Rb ? instr_d(*pc) : 1);
+    int d = (value_t)Ra <= (value_t)Rb ? TAKEN(instr_d(*pc)) : 1;
+    pc += d;
+    if (d <= 0)
+      CHECK_BUDGET();
   } GOTO_NEXT;
 
  l_JEQ: {
-    pc += (Ra == Rb ? instr_d(*pc) : 1);
+    int d = Ra == Rb ? TAKEN(instr_d(*pc)) : 1;
+    pc += d;
+    if (d <= 0)
+      CHECK_BUDGET();
   } GOTO_NEXT;
 
  l_JNE: {
-    pc += (Ra != Rb ? instr_d(*pc) : 1);
+    int d = Ra != Rb ? TAKEN(instr_d(*pc)) : 1;
+    pc += d;
+    if (d <= 0)
+      CHECK_BUDGET();
   } GOTO_NEXT;
 
  l_JI: {
-    pc += instr_extract_s(*pc, 0, 26);
+    int d = instr_extract_s(*pc, 0, 26);
+    pc += d;
+    if (d <= 0)
+      CHECK_BUDGET();
   } GOTO_NEXT;
 
  l_TCAL: {
-    instr_t* target_pc = addr_v_to_p(Ra);
+    instr_t* target_pc = addr_v_to_p(memory_start, Ra);
     R[Ob][0] = R[Ib][0];
     R[Ob][1] = R[Ib][1];
     R[Ob][2] = R[Ib][2];
     R[Ob][3] = R[Ib][3];
-    engine_set_Ib(R[Ob]);
-    engine_set_Lb(memory_start);
-    engine_set_Ob(memory_start);
+    engine_set_Ib(vm, R[Ob]);
+    engine_set_Lb(vm, memory_start);
+    engine_set_Ob(vm, memory_start);
     pc = target_pc;
+    CHECK_BUDGET();
   } GOTO_NEXT;
 
  l_CALL: {
-    instr_t* target_pc = addr_v_to_p(Ra);
-    R[Ob][0] = addr_p_to_v(R[Ib]);
-    R[Ob][1] = addr_p_to_v(R[Lb]);
-    R[Ob][2] = addr_p_to_v(R[Ob]);
-    R[Ob][3] = addr_p_to_v(pc + 1);
-    engine_set_Ib(R[Ob]);
-    engine_set_Lb(memory_start);
-    engine_set_Ob(memory_start);
+    instr_t* target_pc = addr_v_to_p(memory_start, Ra);
+    R[Ob][0] = addr_p_to_v(vm, R[Ib]);
+    R[Ob][1] = addr_p_to_v(vm, R[Lb]);
+    R[Ob][2] = addr_p_to_v(vm, R[Ob]);
+    R[Ob][3] = addr_p_to_v(vm, pc + 1);
+    engine_set_Ib(vm, R[Ob]);
+    engine_set_Lb(vm, memory_start);
+    engine_set_Ob(vm, memory_start);
     pc = target_pc;
+    CHECK_BUDGET();
   } GOTO_NEXT;
 
  l_RET: {
     uvalue_t ret_value = R[Ib][4];
-    instr_t* target_pc = addr_v_to_p(R[Ib][3]);
-    engine_set_Ob(addr_v_to_p(R[Ib][2]));
-    engine_set_Lb(addr_v_to_p(R[Ib][1]));
-    engine_set_Ib(addr_v_to_p(R[Ob][0]));
+    instr_t* target_pc = addr_v_to_p(memory_start, R[Ib][3]);
+    engine_set_Ob(vm, addr_v_to_p(memory_start, R[Ib][2]));
+    engine_set_Lb(vm, addr_v_to_p(memory_start, R[Ib][1]));
+    engine_set_Ib(vm, addr_v_to_p(memory_start, R[Ob][0]));
     R[Ob][0] = ret_value;
     pc = target_pc;
   } GOTO_NEXT;
 
  l_HALT: {
-    return Ra;
+    io_flush(vm->io);
+    vm->halt_code = Ra;
+    vm->pc = pc;
+    return engine_HALTED;
   }
 
  l_LDLO: {
@@ -268,56 +401,109 @@ uvalue_t engine_run() {
   } GOTO_NEXT;
 
  l_RALO: {
+    RECORD_ALLOC_SITE();
     uvalue_t size = instr_extract_u(*pc, 16, 8);
-    uvalue_t* block = memory_allocate(tag_RegisterFrame, size);
+    uvalue_t* block = memory_allocate(vm, tag_RegisterFrame, size);
     switch (instr_extract_u(*pc, 24, 2)) {
-    case 0: engine_set_Lb(block); break;
-    case 1: engine_set_Ib(block); break;
-    case 2: engine_set_Ob(block); break;
+    case 0: engine_set_Lb(vm, block); break;
+    case 1: engine_set_Ib(vm, block); break;
+    case 2: engine_set_Ob(vm, block); break;
     }
     pc += 1;
   } GOTO_NEXT;
 
  l_BALO: {
-    uvalue_t* block = memory_allocate(instr_extract_u(*pc, 2, 8), Rb);
-    Ra = addr_p_to_v(block);
+    RECORD_ALLOC_SITE();
+    uvalue_t* block = memory_allocate(vm, instr_extract_u(*pc, 2, 8), Rb);
+    Ra = addr_p_to_v(vm, block);
     pc += 1;
   } GOTO_NEXT;
 
  l_BSIZ: {
-    Ra = memory_get_block_size(addr_v_to_p(Rb));
+    Ra = memory_get_block_size(addr_v_to_p(memory_start, Rb));
     pc += 1;
   } GOTO_NEXT;
 
  l_BTAG: {
-    Ra = memory_get_block_tag(addr_v_to_p(Rb));
+    Ra = memory_get_block_tag(addr_v_to_p(memory_start, Rb));
     pc += 1;
   } GOTO_NEXT;
 
  l_BGET: {
-    uvalue_t* block = addr_v_to_p(Rb);
+    uvalue_t* block = addr_v_to_p(memory_start, Rb);
     uvalue_t index = Rc;
     Ra = block[index];
     pc += 1;
   } GOTO_NEXT;
 
  l_BSET: {
-    uvalue_t* block = addr_v_to_p(Rb);
+    uvalue_t* block = addr_v_to_p(memory_start, Rb);
     uvalue_t index = Rc;
     block[index] = Ra;
     pc += 1;
   } GOTO_NEXT;
 
+ l_BCPY: {
+    uvalue_t* dst = addr_v_to_p(memory_start, Ra);
+    uvalue_t* src = addr_v_to_p(memory_start, Rb);
+    uvalue_t count = Rc;
+    uvalue_t dst_index = Rd;
+    uvalue_t src_index = Re;
+    check_block_range(dst, dst_index, count);
+    check_block_range(src, src_index, count);
+    block_copy(dst + dst_index, src + src_index, count);
+    pc += 2;
+  } GOTO_NEXT;
+
+ l_BFIL: {
+    uvalue_t* block = addr_v_to_p(memory_start, Ra);
+    uvalue_t count = Rc;
+    uvalue_t index = Rd;
+    check_block_range(block, index, count);
+    block_fill(block + index, Rb, count);
+    pc += 2;
+  } GOTO_NEXT;
+
+ l_BCMP: {
+    uvalue_t* a = addr_v_to_p(memory_start, Rb);
+    uvalue_t* b = addr_v_to_p(memory_start, Rc);
+    Ra = (uvalue_t)block_compare(a, memory_get_block_size(a),
+                                 b, memory_get_block_size(b));
+    pc += 1;
+  } GOTO_NEXT;
+
  l_BREA: {
-    uint8_t byte;
-    size_t read = fread(&byte, sizeof(byte), 1, stdin);
-    Ra = (uvalue_t)(read == sizeof(byte) ? byte : -1);
+    int byte = io_read_byte(vm->io);
+    if (byte == IO_BLOCKED)
+      BLOCK();
+    Ra = (uvalue_t)byte;
     pc += 1;
   } GOTO_NEXT;
 
  l_BWRI: {
-    uint8_t byte = (uint8_t)Ra;
-    fwrite(&byte, sizeof(byte), 1, stdout);
+    io_write_byte(vm->io, (uint8_t)Ra);
+    pc += 1;
+  } GOTO_NEXT;
+
+ l_BRDB: {
+    uvalue_t* block = addr_v_to_p(memory_start, Rb);
+    uvalue_t count = Rc;
+    byte_format_t format = instr_byte_format(*pc);
+    check_block_range(block, 0, count);
+    long read_count = io_read_bytes(vm->io, block, count, format);
+    if (read_count == IO_BLOCKED)
+      BLOCK();
+    Ra = (uvalue_t)read_count;
+    pc += 1;
+  } GOTO_NEXT;
+
+ l_BWRB: {
+    uvalue_t* block = addr_v_to_p(memory_start, Ra);
+    uvalue_t start = Rb;
+    uvalue_t count = Rc;
+    byte_format_t format = instr_byte_format(*pc);
+    check_block_range(block, start, count);
+    io_write_bytes(vm->io, block + start, count, format);
     pc += 1;
   } GOTO_NEXT;
 }
@@ -2,27 +2,56 @@
 #define ENGINE__H
 
 #include "vmtypes.h"
+#include "vm_context.h"
 
 /* Setup the interpreter */
-void engine_setup(void);
+void engine_setup(vm_context_t* vm);
 
 /* Tear down the interpreter */
-void engine_cleanup(void);
+void engine_cleanup(vm_context_t* vm);
 
 /* Add an instruction to the code area of the memory */
-void engine_emit(instr_t instr, instr_t** instr_ptr);
+void engine_emit(vm_context_t* vm, instr_t instr, instr_t** instr_ptr);
 
 /* Return the heap address of the register bank */
-uvalue_t* engine_get_Lb(void);
-uvalue_t* engine_get_Ib(void);
-uvalue_t* engine_get_Ob(void);
+uvalue_t* engine_get_Lb(vm_context_t* vm);
+uvalue_t* engine_get_Ib(vm_context_t* vm);
+uvalue_t* engine_get_Ob(vm_context_t* vm);
 
 /* Set the heap address of the register bank */
-void engine_set_Lb(uvalue_t* new_value);
-void engine_set_Ib(uvalue_t* new_value);
-void engine_set_Ob(uvalue_t* new_value);
-
-/* Interpret the program in the code area of the memory */
-uvalue_t engine_run(void);
+void engine_set_Lb(vm_context_t* vm, uvalue_t* new_value);
+void engine_set_Ib(vm_context_t* vm, uvalue_t* new_value);
+void engine_set_Ob(vm_context_t* vm, uvalue_t* new_value);
+
+#ifdef ALLOC_PROFILE
+/* Return the virtual address of the last allocating instruction */
+uvalue_t engine_get_alloc_site(vm_context_t* vm);
+#endif
+
+typedef enum {
+  engine_HALTED,                /* the program executed HALT */
+  engine_YIELDED,               /* the budget is exhausted */
+  engine_BLOCKED                /* BREA or BRDB is waiting for input */
+} engine_status_t;
+
+/* Prepare the program in the code area of the memory to run from its
+ * first instruction */
+void engine_start(vm_context_t* vm);
+
+/* Interpret the program from where it stopped, until it halts (its halt
+ * code is then in vm->halt_code), until budget backward jumps and calls
+ * have been executed, or until it needs input that is not available
+ * yet (only if the input is non-blocking). The budget is only checked
+ * on backward jumps and calls, every loop of the program going through
+ * one. */
+engine_status_t engine_resume(vm_context_t* vm, uint64_t budget);
+
+/* Interpret the program from where it stopped until it halts, waiting
+ * for input when needed, return its halt code */
+uvalue_t engine_continue(vm_context_t* vm);
+
+/* Interpret the program in the code area of the memory until it halts,
+ * return its halt code */
+uvalue_t engine_run(vm_context_t* vm);
 
 #endif // ENGINE__H
@@ -4,14 +4,52 @@
 
 #include "fail.h"
 
+static _Thread_local void (*fail_cleanup)(void*) = NULL;
+static _Thread_local void* fail_cleanup_arg = NULL;
+static _Thread_local jmp_buf* fail_handler = NULL;
+
+void fail_set_cleanup(void (*cleanup)(void*), void* arg) {
+  fail_cleanup = cleanup;
+  fail_cleanup_arg = arg;
+}
+
+void fail_set_handler(jmp_buf* target) {
+  fail_handler = target;
+}
+
+bool fail_try(void (*fn)(void*), void* arg) {
+  jmp_buf* outer = fail_handler;
+  jmp_buf on_fail;
+  if (setjmp(on_fail) != 0) {
+    fail_handler = outer;
+    return false;
+  }
+  fail_handler = &on_fail;
+  fn(arg);
+  fail_handler = outer;
+  return true;
+}
+
 /* A method to indicate vm failure */
 void fail(char* msg, ...) {
+  /* the cleanup function may fail itself, only call it once */
+  void (*cleanup)(void*) = fail_cleanup;
+  fail_cleanup = NULL;
+  if (cleanup != NULL)
+    cleanup(fail_cleanup_arg);
+
+  /* format the message first, so that it is written at once even if
+     several threads fail */
+  char message[1024];
   va_list arg_list;
   va_start(arg_list, msg);
-  fprintf(stderr, "Error: ");
-  vfprintf(stderr, msg, arg_list);
-  fprintf(stderr, "\n");
-  fflush(stderr);
+  vsnprintf(message, sizeof(message), msg, arg_list);
   va_end(arg_list);
+  fprintf(stderr, "Error: %s\n", message);
+  fflush(stderr);
+
+  jmp_buf* handler = fail_handler;
+  if (handler != NULL)
+    longjmp(*handler, 1);
   exit(1);
 }
@@ -1,7 +1,24 @@
 #ifndef FAIL_H
 #define FAIL_H
 
+#include <setjmp.h>
+#include <stdbool.h>
+
 /* A method to indicate vm failure */
 extern void fail(char* msg, ...) __attribute__ ((noreturn));
 
+/* Set a function called with arg by fail before reporting the error,
+   e.g. to flush the output of the program (NULL for none); the setting
+   is local to the calling thread */
+extern void fail_set_cleanup(void (*cleanup)(void*), void* arg);
+
+/* Make fail return to target with longjmp after reporting the error,
+   instead of exiting the process (NULL to exit); the setting is local
+   to the calling thread */
+extern void fail_set_handler(jmp_buf* target);
+
+/* Call fn(arg) with fail returning here instead of exiting the process;
+   return false if fn failed */
+extern bool fail_try(void (*fn)(void*), void* arg);
+
 #endif // FAIL_H
@@ -0,0 +1,66 @@
+#include "heap_dump.h"
+#include "fail.h"
+
+static void write_words(FILE* file, const uint32_t* words, size_t count) {
+  if (fwrite(words, sizeof(uint32_t), count, file) != count)
+    fail("cannot write heap dump");
+}
+
+static bool read_words(FILE* file, uint32_t* words, size_t count) {
+  return fread(words, sizeof(uint32_t), count, file) == count;
+}
+
+void heap_dump_write_header(FILE* file, const heap_dump_header_t* header) {
+  const uint32_t words[] = {
+    header->magic, header->version, header->reason, header->gc_count,
+    header->heap_start, header->heap_end,
+    header->roots[0], header->roots[1], header->roots[2],
+    header->block_count
+  };
+  write_words(file, words, sizeof(words) / sizeof(words[0]));
+}
+
+void heap_dump_write_block(FILE* file, const heap_dump_block_t* block,
+                           const uint32_t* pointers) {
+  const uint32_t words[] = {
+    block->address, block->tag, block->size, block->flags,
+    block->pointer_count
+  };
+  write_words(file, words, sizeof(words) / sizeof(words[0]));
+  write_words(file, pointers, block->pointer_count);
+}
+
+bool heap_dump_read_header(FILE* file, heap_dump_header_t* header) {
+  uint32_t words[10];
+  header->magic = 0;
+  if (!read_words(file, words, 10))
+    return false;
+  header->magic = words[0];
+  header->version = words[1];
+  header->reason = words[2];
+  header->gc_count = words[3];
+  header->heap_start = words[4];
+  header->heap_end = words[5];
+  header->roots[0] = words[6];
+  header->roots[1] = words[7];
+  header->roots[2] = words[8];
+  header->block_count = words[9];
+  return header->magic == HEAP_DUMP_MAGIC
+    && header->version == HEAP_DUMP_VERSION;
+}
+
+bool heap_dump_read_block(FILE* file, heap_dump_block_t* block) {
+  uint32_t words[5];
+  if (!read_words(file, words, 5))
+    return false;
+  block->address = words[0];
+  block->tag = words[1];
+  block->size = words[2];
+  block->flags = words[3];
+  block->pointer_count = words[4];
+  return true;
+}
+
+bool heap_dump_read_pointers(FILE* file, uint32_t* pointers, uint32_t count) {
+  return read_words(file, pointers, count);
+}
@@ -0,0 +1,79 @@
+#ifndef HEAP_DUMP_H
+#define HEAP_DUMP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Heap snapshot format, written by the VM and read by heapstat.
+ *
+ * All fields are 32-bit unsigned integers in the byte order of the
+ * machine that wrote the dump. Addresses are virtual (byte offsets from
+ * the start of the memory). A dump is a header followed by one record
+ * per heap block, in address order:
+ *
+ *   header: magic version reason gc_count heap_start heap_end
+ *           root_Ib root_Lb root_Ob block_count
+ *   block:  address tag size flags pointer_count pointer...
+ *
+ * The pointers of a block are the values of its fields that look like
+ * heap addresses, as seen by the marking phase of the GC. They are not
+ * guaranteed to be block addresses.
+ *
+ * Version 2 added block_flag_HEADERLESS: the blocks of version 1 dumps
+ * all had a header, and a reader of version 1 would count one for the
+ * blocks of version 2 dumps that have none. Dumps of another version are
+ * rejected. */
+
+#define HEAP_DUMP_MAGIC 0x504d4448u /* "HDMP" */
+#define HEAP_DUMP_VERSION 2u
+
+typedef enum {
+  dump_reason_OOM = 0,
+  dump_reason_SIGNAL = 1,
+  dump_reason_PERIODIC = 2
+} dump_reason_t;
+
+typedef enum {
+  block_flag_FREE = 1,
+  block_flag_LIVE = 2,
+  block_flag_HEADERLESS = 4     /* shares the header of its page */
+} block_flag_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t reason;
+  uint32_t gc_count;
+  uint32_t heap_start;
+  uint32_t heap_end;
+  uint32_t roots[3];
+  uint32_t block_count;
+} heap_dump_header_t;
+
+typedef struct {
+  uint32_t address;
+  uint32_t tag;
+  uint32_t size;                /* in words, header excluded */
+  uint32_t flags;
+  uint32_t pointer_count;
+} heap_dump_block_t;
+
+/* Write the header, or rewrite it once block_count is known */
+void heap_dump_write_header(FILE* file, const heap_dump_header_t* header);
+
+/* Write a block record followed by its pointers */
+void heap_dump_write_block(FILE* file, const heap_dump_block_t* block,
+                           const uint32_t* pointers);
+
+/* Read and check the header, return false on error, including when the
+ * dump is of another version, which is then left in header->version */
+bool heap_dump_read_header(FILE* file, heap_dump_header_t* header);
+
+/* Read a block record, without its pointers; return false on error */
+bool heap_dump_read_block(FILE* file, heap_dump_block_t* block);
+
+/* Read the pointer_count pointers following a block record */
+bool heap_dump_read_pointers(FILE* file, uint32_t* pointers, uint32_t count);
+
+#endif // HEAP_DUMP_H
@@ -0,0 +1,498 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "heap_dump.h"
+#include "memory.h"
+#include "fail.h"
+
+/* Offline analyzer for heap dumps written by the VM (option -d) */
+
+#define TAG_COUNT 256
+#define SIZE_BUCKETS 33
+#define NO_NODE UINT32_MAX
+
+typedef struct {
+  heap_dump_header_t header;
+  heap_dump_block_t* blocks;
+  uint32_t* pointer_start;      /* index of each block's first pointer */
+  uint32_t* pointers;
+  uint32_t pointer_count;
+} heap_t;
+
+typedef struct {
+  uint32_t node_count;          /* live blocks, plus the root at index 0 */
+  uint32_t* block_of_node;
+  uint32_t* edge_start;         /* successors, CSR-encoded */
+  uint32_t* edges;
+  uint32_t* pred_start;         /* predecessors, CSR-encoded */
+  uint32_t* preds;
+  uint32_t* idom;
+  uint64_t* retained;           /* in bytes */
+  uint32_t* rpo;                /* reachable nodes in reverse postorder */
+  uint32_t rpo_count;
+} graph_t;
+
+static void* checked_calloc(size_t count, size_t size) {
+  void* ptr = calloc(count == 0 ? 1 : count, size);
+  if (ptr == NULL)
+    fail("cannot allocate %zu bytes", count * size);
+  return ptr;
+}
+
+static const char* tag_name(uint32_t tag) {
+  switch (tag) {
+  case tag_String: return "String";
+  case tag_RegisterFrame: return "RegisterFrame";
+  case tag_Function: return "Function";
+  case tag_None: return "free";
+  default: return NULL;
+  }
+}
+
+static void print_tag(uint32_t tag) {
+  const char* name = tag_name(tag);
+  if (name != NULL)
+    printf("%-14s", name);
+  else
+    printf("%-14u", tag);
+}
+
+/* Bytes occupied by a block, header included */
+static uint64_t block_bytes(const heap_dump_block_t* block) {
+  uint32_t words = block->size;
+  if (!(block->flags & block_flag_FREE) && words == 0)
+    words = 1;
+  if (!(block->flags & block_flag_HEADERLESS))
+    words += 1;
+  return (uint64_t)words * sizeof(uint32_t);
+}
+
+// Loading
+
+static void load_dump(char* file_name, heap_t* heap) {
+  FILE* file = fopen(file_name, "rb");
+  if (file == NULL)
+    fail("cannot open file %s", file_name);
+  if (!heap_dump_read_header(file, &heap->header)) {
+    if (heap->header.magic == HEAP_DUMP_MAGIC)
+      fail("%s is a heap dump of version %u, not %u", file_name,
+           heap->header.version, HEAP_DUMP_VERSION);
+    fail("%s is not a heap dump", file_name);
+  }
+
+  uint32_t count = heap->header.block_count;
+  heap->blocks = checked_calloc(count, sizeof(heap_dump_block_t));
+  heap->pointer_start = checked_calloc(count + 1, sizeof(uint32_t));
+
+  uint32_t capacity = 1024;
+  heap->pointers = checked_calloc(capacity, sizeof(uint32_t));
+  heap->pointer_count = 0;
+
+  for (uint32_t i = 0; i < count; ++i) {
+    heap_dump_block_t* block = &heap->blocks[i];
+    if (!heap_dump_read_block(file, block))
+      fail("truncated heap dump %s", file_name);
+
+    while (heap->pointer_count + block->pointer_count > capacity) {
+      capacity *= 2;
+      heap->pointers = realloc(heap->pointers, capacity * sizeof(uint32_t));
+      if (heap->pointers == NULL)
+        fail("cannot allocate pointer table");
+    }
+    heap->pointer_start[i] = heap->pointer_count;
+    if (!heap_dump_read_pointers(file, heap->pointers + heap->pointer_count,
+                                 block->pointer_count))
+      fail("truncated heap dump %s", file_name);
+    heap->pointer_count += block->pointer_count;
+  }
+  heap->pointer_start[count] = heap->pointer_count;
+  fclose(file);
+}
+
+/* Index of the block at address, or NO_NODE; blocks are sorted */
+static uint32_t find_block(const heap_t* heap, uint32_t address) {
+  uint32_t low = 0, high = heap->header.block_count;
+  while (low < high) {
+    uint32_t mid = low + (high - low) / 2;
+    if (heap->blocks[mid].address < address)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  if (low < heap->header.block_count && heap->blocks[low].address == address)
+    return low;
+  return NO_NODE;
+}
+
+// Fragmentation
+
+static unsigned int size_bucket(uint32_t words) {
+  unsigned int bucket = 0;
+  while (words > 0) {
+    bucket += 1;
+    words >>= 1;
+  }
+  return bucket;
+}
+
+static void report_fragmentation(const heap_t* heap) {
+  uint64_t free_count[SIZE_BUCKETS] = { 0 };
+  uint64_t free_bytes[SIZE_BUCKETS] = { 0 };
+  uint64_t total_free = 0, largest_free = 0, live = 0, dead = 0;
+  uint32_t free_blocks = 0, live_blocks = 0, dead_blocks = 0;
+
+  for (uint32_t i = 0; i < heap->header.block_count; ++i) {
+    const heap_dump_block_t* block = &heap->blocks[i];
+    uint64_t bytes = block_bytes(block);
+    if (block->flags & block_flag_FREE) {
+      unsigned int bucket = size_bucket(block->size);
+      free_count[bucket] += 1;
+      free_bytes[bucket] += bytes;
+      total_free += bytes;
+      free_blocks += 1;
+      if (bytes > largest_free)
+        largest_free = bytes;
+    } else if (block->flags & block_flag_LIVE) {
+      live += bytes;
+      live_blocks += 1;
+    } else {
+      dead += bytes;
+      dead_blocks += 1;
+    }
+  }
+
+  uint64_t heap_bytes = heap->header.heap_end - heap->header.heap_start;
+  printf("Heap: %llu bytes\n", (unsigned long long)heap_bytes);
+  printf("  live: %10llu bytes in %8u blocks (%5.1f%%)\n",
+         (unsigned long long)live, live_blocks,
+         100.0 * (double)live / (double)heap_bytes);
+  printf("  dead: %10llu bytes in %8u blocks (%5.1f%%)\n",
+         (unsigned long long)dead, dead_blocks,
+         100.0 * (double)dead / (double)heap_bytes);
+  printf("  free: %10llu bytes in %8u blocks (%5.1f%%)\n",
+         (unsigned long long)total_free, free_blocks,
+         100.0 * (double)total_free / (double)heap_bytes);
+
+  /* 0 when all free memory is in one block, close to 1 when it is
+     scattered in many small blocks */
+  double fragmentation = total_free == 0
+    ? 0.0 : 1.0 - (double)largest_free / (double)total_free;
+  printf("Largest free block: %llu bytes\n",
+         (unsigned long long)largest_free);
+  printf("Fragmentation index: %.3f\n", fragmentation);
+
+  printf("\nFree block sizes (words, header excluded):\n");
+  for (unsigned int b = 0; b < SIZE_BUCKETS; ++b) {
+    if (free_count[b] == 0)
+      continue;
+    uint64_t low = b == 0 ? 0 : (uint64_t)1 << (b - 1);
+    uint64_t high = b == 0 ? 0 : ((uint64_t)1 << b) - 1;
+    printf("  %8llu - %-8llu %10llu blocks %12llu bytes\n",
+           (unsigned long long)low, (unsigned long long)high,
+           (unsigned long long)free_count[b],
+           (unsigned long long)free_bytes[b]);
+  }
+}
+
+// Object graph and dominators
+
+static void build_graph(const heap_t* heap, graph_t* graph) {
+  uint32_t block_count = heap->header.block_count;
+  uint32_t* node_of_block = checked_calloc(block_count, sizeof(uint32_t));
+
+  graph->node_count = 1;
+  for (uint32_t i = 0; i < block_count; ++i) {
+    node_of_block[i] = NO_NODE;
+    if (heap->blocks[i].flags & block_flag_LIVE)
+      node_of_block[i] = graph->node_count++;
+  }
+
+  uint32_t n = graph->node_count;
+  graph->block_of_node = checked_calloc(n, sizeof(uint32_t));
+  graph->edge_start = checked_calloc(n + 1, sizeof(uint32_t));
+  graph->edges = checked_calloc(heap->pointer_count + 3, sizeof(uint32_t));
+  graph->block_of_node[0] = NO_NODE;
+
+  uint32_t edge_count = 0;
+  graph->edge_start[0] = 0;
+  for (int r = 0; r < 3; ++r) {
+    uint32_t target = find_block(heap, heap->header.roots[r]);
+    if (target != NO_NODE && node_of_block[target] != NO_NODE)
+      graph->edges[edge_count++] = node_of_block[target];
+  }
+  for (uint32_t i = 0; i < block_count; ++i) {
+    uint32_t node = node_of_block[i];
+    if (node == NO_NODE)
+      continue;
+    graph->block_of_node[node] = i;
+    graph->edge_start[node] = edge_count;
+    for (uint32_t p = heap->pointer_start[i]; p < heap->pointer_start[i + 1];
+         ++p) {
+      uint32_t target = find_block(heap, heap->pointers[p]);
+      if (target != NO_NODE && node_of_block[target] != NO_NODE)
+        graph->edges[edge_count++] = node_of_block[target];
+    }
+  }
+  graph->edge_start[n] = edge_count;
+
+  graph->pred_start = checked_calloc(n + 1, sizeof(uint32_t));
+  graph->preds = checked_calloc(edge_count, sizeof(uint32_t));
+  for (uint32_t e = 0; e < edge_count; ++e)
+    graph->pred_start[graph->edges[e] + 1] += 1;
+  for (uint32_t v = 0; v < n; ++v)
+    graph->pred_start[v + 1] += graph->pred_start[v];
+  uint32_t* fill = checked_calloc(n, sizeof(uint32_t));
+  for (uint32_t v = 0; v < n; ++v) {
+    for (uint32_t e = graph->edge_start[v]; e < graph->edge_start[v + 1]; ++e) {
+      uint32_t w = graph->edges[e];
+      graph->preds[graph->pred_start[w] + fill[w]++] = v;
+    }
+  }
+  free(fill);
+  free(node_of_block);
+}
+
+/* Iterative depth-first search from the root, fills graph->rpo */
+static void compute_rpo(graph_t* graph, uint32_t* postorder) {
+  uint32_t n = graph->node_count;
+  uint32_t* stack = checked_calloc(n, sizeof(uint32_t));
+  uint32_t* next_edge = checked_calloc(n, sizeof(uint32_t));
+  bool* visited = checked_calloc(n, sizeof(bool));
+  uint32_t* order = checked_calloc(n, sizeof(uint32_t));
+  uint32_t order_count = 0, depth = 0;
+
+  stack[depth++] = 0;
+  visited[0] = true;
+  next_edge[0] = graph->edge_start[0];
+  while (depth > 0) {
+    uint32_t v = stack[depth - 1];
+    if (next_edge[v] < graph->edge_start[v + 1]) {
+      uint32_t w = graph->edges[next_edge[v]++];
+      if (!visited[w]) {
+        visited[w] = true;
+        next_edge[w] = graph->edge_start[w];
+        stack[depth++] = w;
+      }
+    } else {
+      postorder[v] = order_count;
+      order[order_count++] = v;
+      depth -= 1;
+    }
+  }
+
+  graph->rpo = checked_calloc(order_count, sizeof(uint32_t));
+  graph->rpo_count = order_count;
+  for (uint32_t i = 0; i < order_count; ++i)
+    graph->rpo[i] = order[order_count - 1 - i];
+
+  free(order);
+  free(visited);
+  free(next_edge);
+  free(stack);
+}
+
+static uint32_t intersect(const graph_t* graph, const uint32_t* postorder,
+                          uint32_t a, uint32_t b) {
+  while (a != b) {
+    while (postorder[a] < postorder[b])
+      a = graph->idom[a];
+    while (postorder[b] < postorder[a])
+      b = graph->idom[b];
+  }
+  return a;
+}
+
+/* Cooper, Harvey and Kennedy's iterative dominator algorithm */
+static void compute_dominators(const heap_t* heap, graph_t* graph) {
+  uint32_t n = graph->node_count;
+  uint32_t* postorder = checked_calloc(n, sizeof(uint32_t));
+  compute_rpo(graph, postorder);
+
+  graph->idom = checked_calloc(n, sizeof(uint32_t));
+  for (uint32_t v = 0; v < n; ++v)
+    graph->idom[v] = NO_NODE;
+  graph->idom[0] = 0;
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (uint32_t i = 1; i < graph->rpo_count; ++i) {
+      uint32_t v = graph->rpo[i];
+      uint32_t new_idom = NO_NODE;
+      for (uint32_t p = graph->pred_start[v]; p < graph->pred_start[v + 1];
+           ++p) {
+        uint32_t pred = graph->preds[p];
+        if (graph->idom[pred] == NO_NODE)
+          continue;
+        new_idom = new_idom == NO_NODE
+          ? pred : intersect(graph, postorder, pred, new_idom);
+      }
+      if (graph->idom[v] != new_idom) {
+        graph->idom[v] = new_idom;
+        changed = true;
+      }
+    }
+  }
+
+  graph->retained = checked_calloc(n, sizeof(uint64_t));
+  for (uint32_t i = 0; i < graph->rpo_count; ++i) {
+    uint32_t v = graph->rpo[i];
+    if (v != 0)
+      graph->retained[v] = block_bytes(&heap->blocks[graph->block_of_node[v]]);
+  }
+  for (uint32_t i = graph->rpo_count; i-- > 1; ) {
+    uint32_t v = graph->rpo[i];
+    graph->retained[graph->idom[v]] += graph->retained[v];
+  }
+  free(postorder);
+}
+
+// Retention reports
+
+/* Retained size per tag: a block only counts if none of its dominators
+   has the same tag, so nested structures are not counted twice */
+static void report_tags(const heap_t* heap, const graph_t* graph) {
+  uint64_t count[TAG_COUNT] = { 0 };
+  uint64_t shallow[TAG_COUNT] = { 0 };
+  uint64_t retained[TAG_COUNT] = { 0 };
+  uint32_t on_path[TAG_COUNT] = { 0 };
+
+  uint32_t n = graph->node_count;
+  uint32_t* child_start = checked_calloc(n + 1, sizeof(uint32_t));
+  uint32_t* children = checked_calloc(n, sizeof(uint32_t));
+  for (uint32_t i = 1; i < graph->rpo_count; ++i)
+    child_start[graph->idom[graph->rpo[i]] + 1] += 1;
+  for (uint32_t v = 0; v < n; ++v)
+    child_start[v + 1] += child_start[v];
+  uint32_t* fill = checked_calloc(n, sizeof(uint32_t));
+  for (uint32_t i = 1; i < graph->rpo_count; ++i) {
+    uint32_t v = graph->rpo[i], d = graph->idom[v];
+    children[child_start[d] + fill[d]++] = v;
+  }
+
+  uint32_t* stack = checked_calloc(n, sizeof(uint32_t));
+  uint32_t* next_child = fill;
+  uint32_t depth = 0;
+  stack[depth++] = 0;
+  next_child[0] = child_start[0];
+  while (depth > 0) {
+    uint32_t v = stack[depth - 1];
+    if (next_child[v] < child_start[v + 1]) {
+      uint32_t w = children[next_child[v]++];
+      const heap_dump_block_t* block = &heap->blocks[graph->block_of_node[w]];
+      count[block->tag] += 1;
+      shallow[block->tag] += block_bytes(block);
+      if (on_path[block->tag]++ == 0)
+        retained[block->tag] += graph->retained[w];
+      next_child[w] = child_start[w];
+      stack[depth++] = w;
+    } else {
+      if (v != 0)
+        on_path[heap->blocks[graph->block_of_node[v]].tag] -= 1;
+      depth -= 1;
+    }
+  }
+
+  printf("\nReachable blocks per tag:\n");
+  printf("  %-14s %10s %14s %14s\n", "tag", "blocks", "shallow", "retained");
+  for (uint32_t tag = 0; tag < TAG_COUNT; ++tag) {
+    if (count[tag] == 0)
+      continue;
+    printf("  ");
+    print_tag(tag);
+    printf(" %10llu %14llu %14llu\n", (unsigned long long)count[tag],
+           (unsigned long long)shallow[tag], (unsigned long long)retained[tag]);
+  }
+
+  free(stack);
+  free(fill);
+  free(children);
+  free(child_start);
+}
+
+static const graph_t* sort_graph;
+
+static int compare_retained(const void* a, const void* b) {
+  uint64_t ra = sort_graph->retained[*(const uint32_t*)a];
+  uint64_t rb = sort_graph->retained[*(const uint32_t*)b];
+  return (ra < rb) - (ra > rb);
+}
+
+static void report_largest(const heap_t* heap, const graph_t* graph,
+                           uint32_t top_n) {
+  uint32_t count = graph->rpo_count - 1;
+  uint32_t* order = checked_calloc(count, sizeof(uint32_t));
+  memcpy(order, graph->rpo + 1, count * sizeof(uint32_t));
+  sort_graph = graph;
+  qsort(order, count, sizeof(uint32_t), compare_retained);
+
+  uint32_t shown = count < top_n ? count : top_n;
+  printf("\nTop %u structures by retained size:\n", shown);
+  printf("  %-10s %-14s %10s %14s %10s\n",
+         "address", "tag", "size", "retained", "dominator");
+  for (uint32_t i = 0; i < shown; ++i) {
+    uint32_t v = order[i];
+    const heap_dump_block_t* block = &heap->blocks[graph->block_of_node[v]];
+    printf("  %08x   ", block->address);
+    print_tag(block->tag);
+    printf(" %10u %14llu ", block->size,
+           (unsigned long long)graph->retained[v]);
+    if (graph->idom[v] == 0)
+      printf("%10s\n", "root");
+    else
+      printf("  %08x\n",
+             heap->blocks[graph->block_of_node[graph->idom[v]]].address);
+  }
+  free(order);
+}
+
+static void display_usage(char* prog_name) {
+  printf("Usage: %s [<options>] <dump_file>\n", prog_name);
+  printf("\noptions:\n");
+  printf("  -h         display this help message and exit\n");
+  printf("  -n <n>     number of structures to display (default 20)\n");
+}
+
+int main(int argc, char* argv[]) {
+  char* file_name = NULL;
+  uint32_t top_n = 20;
+
+  int i = 1;
+  while (i < argc) {
+    char* arg = argv[i++];
+    if (strcmp(arg, "-h") == 0) {
+      display_usage(argv[0]);
+      return 0;
+    } else if (strcmp(arg, "-n") == 0 && i < argc) {
+      top_n = (uint32_t)strtoul(argv[i++], NULL, 10);
+    } else if (arg[0] == '-') {
+      display_usage(argv[0]);
+      fail("invalid option %s", arg);
+    } else
+      file_name = arg;
+  }
+  if (file_name == NULL) {
+    display_usage(argv[0]);
+    fail("missing dump file name");
+  }
+
+  heap_t heap;
+  load_dump(file_name, &heap);
+
+  static const char* reasons[] = { "allocation failure", "signal", "periodic" };
+  printf("Dump %s: %s, after %u collections, %u blocks\n", file_name,
+         heap.header.reason < 3 ? reasons[heap.header.reason] : "unknown",
+         heap.header.gc_count, heap.header.block_count);
+  report_fragmentation(&heap);
+
+  graph_t graph;
+  build_graph(&heap, &graph);
+  compute_dominators(&heap, &graph);
+  report_tags(&heap, &graph);
+  report_largest(&heap, &graph, top_n);
+
+  return 0;
+}
@@ -0,0 +1,279 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+
+#include "io.h"
+#include "fail.h"
+
+#define IO_BUFFER_SIZE (64 * 1024)
+
+#define CHAR_SHIFT 3
+#define CHAR_TAG 6
+
+struct io {
+  int in_fd;
+  int out_fd;
+
+  uint8_t in_buffer[IO_BUFFER_SIZE];
+  size_t in_pos;
+  size_t in_len;
+
+  /* Two output buffers: the interpreter fills one while the writer
+     thread writes the other */
+  uint8_t out_buffers[2][IO_BUFFER_SIZE];
+  uint8_t* out_buffer;
+  size_t out_pos;
+
+  bool use_writer;
+  pthread_t writer;
+  pthread_mutex_t writer_lock;
+  pthread_cond_t writer_cond;
+  uint8_t* pending;             /* buffer handed to the writer */
+  size_t pending_len;
+  bool writer_stop;
+  bool writer_failed;
+};
+
+/* Wait until fd is ready for events, which it may never be if it is
+   blocking; return false on error */
+static bool wait_fd(int fd, short events) {
+  struct pollfd poll_fd = { fd, events, 0 };
+  for (;;) {
+    int ready = poll(&poll_fd, 1, -1);
+    if (ready >= 0)
+      return true;
+    if (errno != EINTR)
+      return false;
+  }
+}
+
+static bool is_blocked(void) {
+  return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+static bool write_all(int fd, const uint8_t* data, size_t len) {
+  while (len > 0) {
+    ssize_t written = write(fd, data, len);
+    if (written < 0) {
+      if (errno == EINTR || (is_blocked() && wait_fd(fd, POLLOUT)))
+        continue;
+      return false;
+    }
+    data += written;
+    len -= (size_t)written;
+  }
+  return true;
+}
+
+// Writer thread
+
+static void* writer_main(void* arg) {
+  io_t* io = arg;
+  pthread_mutex_lock(&io->writer_lock);
+  for (;;) {
+    while (io->pending == NULL && !io->writer_stop)
+      pthread_cond_wait(&io->writer_cond, &io->writer_lock);
+    if (io->pending == NULL)
+      break;
+
+    uint8_t* data = io->pending;
+    size_t len = io->pending_len;
+    pthread_mutex_unlock(&io->writer_lock);
+    bool ok = write_all(io->out_fd, data, len);
+    pthread_mutex_lock(&io->writer_lock);
+
+    io->writer_failed |= !ok;
+    io->pending = NULL;
+    pthread_cond_broadcast(&io->writer_cond);
+  }
+  pthread_mutex_unlock(&io->writer_lock);
+  return NULL;
+}
+
+/* Wait until the writer is idle; must hold writer_lock */
+static void wait_writer(io_t* io) {
+  while (io->pending != NULL)
+    pthread_cond_wait(&io->writer_cond, &io->writer_lock);
+  if (io->writer_failed) {
+    io->writer_failed = false;
+    pthread_mutex_unlock(&io->writer_lock);
+    fail("cannot write output");
+  }
+}
+
+/* Hand the current buffer over to the writer and switch to the other */
+static void hand_over(io_t* io) {
+  pthread_mutex_lock(&io->writer_lock);
+  wait_writer(io);
+  io->pending = io->out_buffer;
+  io->pending_len = io->out_pos;
+  pthread_cond_broadcast(&io->writer_cond);
+  pthread_mutex_unlock(&io->writer_lock);
+
+  io->out_buffer = io->out_buffer == io->out_buffers[0]
+    ? io->out_buffers[1] : io->out_buffers[0];
+  io->out_pos = 0;
+}
+
+// Output
+
+static void flush_output(io_t* io, bool wait) {
+  if (io->use_writer) {
+    if (io->out_pos > 0)
+      hand_over(io);
+    if (wait) {
+      pthread_mutex_lock(&io->writer_lock);
+      wait_writer(io);
+      pthread_mutex_unlock(&io->writer_lock);
+    }
+  } else if (io->out_pos > 0) {
+    size_t len = io->out_pos;
+    io->out_pos = 0;
+    if (!write_all(io->out_fd, io->out_buffer, len))
+      fail("cannot write output");
+  }
+}
+
+void io_write_byte(io_t* io, uint8_t byte) {
+  if (io->out_pos == IO_BUFFER_SIZE)
+    flush_output(io, false);
+  io->out_buffer[io->out_pos++] = byte;
+}
+
+void io_write_bytes(io_t* io, const uvalue_t* words, size_t count,
+                    byte_format_t format) {
+  const unsigned int shift = format == byte_format_CHAR ? CHAR_SHIFT : 0;
+  while (count > 0) {
+    if (io->out_pos == IO_BUFFER_SIZE)
+      flush_output(io, false);
+    size_t chunk = IO_BUFFER_SIZE - io->out_pos;
+    if (chunk > count)
+      chunk = count;
+
+    uint8_t* out = io->out_buffer + io->out_pos;
+    for (size_t i = 0; i < chunk; ++i)
+      out[i] = (uint8_t)(words[i] >> shift);
+    io->out_pos += chunk;
+    words += chunk;
+    count -= chunk;
+  }
+}
+
+void io_flush(io_t* io) {
+  flush_output(io, true);
+}
+
+static void flush_on_fail(void* io) {
+  io_flush(io);
+}
+
+// Input
+
+/* Refill the empty input buffer, return the number of bytes read, 0 at
+   end of file or IO_BLOCKED */
+static long fill_input(io_t* io) {
+  /* like stdio, make prompts visible before waiting for input */
+  io_flush(io);
+  for (;;) {
+    ssize_t read_count = read(io->in_fd, io->in_buffer, IO_BUFFER_SIZE);
+    if (read_count < 0 && errno == EINTR)
+      continue;
+    if (read_count < 0 && is_blocked())
+      return IO_BLOCKED;
+    if (read_count < 0)
+      fail("cannot read input");
+    io->in_pos = 0;
+    io->in_len = read_count > 0 ? (size_t)read_count : 0;
+    return (long)io->in_len;
+  }
+}
+
+int io_read_byte(io_t* io) {
+  if (io->in_pos == io->in_len) {
+    long filled = fill_input(io);
+    if (filled <= 0)
+      return filled == IO_BLOCKED ? IO_BLOCKED : -1;
+  }
+  return io->in_buffer[io->in_pos++];
+}
+
+void io_wait_input(io_t* io) {
+  if (io->in_pos == io->in_len && !wait_fd(io->in_fd, POLLIN))
+    fail("cannot wait for input");
+}
+
+long io_read_bytes(io_t* io, uvalue_t* words, size_t count,
+                   byte_format_t format) {
+  if (count == 0)
+    return 0;
+  if (io->in_pos == io->in_len) {
+    long filled = fill_input(io);
+    if (filled <= 0)
+      return filled;
+  }
+
+  size_t available = io->in_len - io->in_pos;
+  if (count > available)
+    count = available;
+
+  const uint8_t* in = io->in_buffer + io->in_pos;
+  if (format == byte_format_CHAR) {
+    for (size_t i = 0; i < count; ++i)
+      words[i] = ((uvalue_t)in[i] << CHAR_SHIFT) | CHAR_TAG;
+  } else {
+    for (size_t i = 0; i < count; ++i)
+      words[i] = in[i];
+  }
+  io->in_pos += count;
+  return (long)count;
+}
+
+// Setup and teardown
+
+io_t* io_setup(int in_fd, int out_fd, bool writer_thread) {
+  io_t* io = malloc(sizeof(io_t));
+  if (io == NULL)
+    fail("cannot allocate I/O buffers");
+  io->in_fd = in_fd;
+  io->out_fd = out_fd;
+  io->in_pos = io->in_len = 0;
+  io->out_buffer = io->out_buffers[0];
+  io->out_pos = 0;
+  io->use_writer = false;
+
+  if (writer_thread) {
+    pthread_mutex_init(&io->writer_lock, NULL);
+    pthread_cond_init(&io->writer_cond, NULL);
+    io->writer_stop = false;
+    io->writer_failed = false;
+    io->pending = NULL;
+    if (pthread_create(&io->writer, NULL, writer_main, io) != 0)
+      fail("cannot start writer thread");
+    io->use_writer = true;
+  }
+  return io;
+}
+
+void io_flush_on_fail(io_t* io) {
+  fail_set_cleanup(flush_on_fail, io);
+}
+
+void io_cleanup(io_t* io) {
+  io_flush(io);
+  fail_set_cleanup(NULL, NULL);
+  if (io->use_writer) {
+    pthread_mutex_lock(&io->writer_lock);
+    io->writer_stop = true;
+    pthread_cond_broadcast(&io->writer_cond);
+    pthread_mutex_unlock(&io->writer_lock);
+    pthread_join(io->writer, NULL);
+    pthread_cond_destroy(&io->writer_cond);
+    pthread_mutex_destroy(&io->writer_lock);
+  }
+  free(io);
+}
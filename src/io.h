@@ -0,0 +1,61 @@
+#ifndef IO_H
+#define IO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "vmtypes.h"
+
+/* Buffered byte I/O on the standard input and output of the VM, used by
+ * BREA, BWRI, BRDB and BWRB instead of stdio. The output buffer is flushed when it
+ * is full, before blocking on input, on HALT and on failure. */
+
+typedef struct io io_t;
+
+/* Returned by the read functions when the input is non-blocking and no
+ * byte is available yet */
+#define IO_BLOCKED (-2)
+
+/* How bytes are stored in the words of a block by BRDB and BWRB */
+typedef enum {
+  byte_format_RAW = 0,          /* one byte per word */
+  byte_format_CHAR = 1          /* one L3 character per word: byte << 3 | 6 */
+} byte_format_t;
+
+#define BYTE_FORMAT_COUNT (byte_format_CHAR+1)
+
+/* Setup the buffers of a program reading in_fd and writing out_fd; if
+ * writer_thread is true, full output buffers are written by a background
+ * thread */
+io_t* io_setup(int in_fd, int out_fd, bool writer_thread);
+
+/* Make fail flush the output of io in the calling thread, which must be
+ * redone whenever the thread switches to running another program */
+void io_flush_on_fail(io_t* io);
+
+/* Flush the output, stop the writer thread and free the buffers; fail
+ * no longer flushes any output in the calling thread */
+void io_cleanup(io_t* io);
+
+/* Read a byte from the standard input, return -1 at end of file */
+int io_read_byte(io_t* io);
+
+/* Wait until input is available or the end of the input is reached */
+void io_wait_input(io_t* io);
+
+/* Write a byte to the standard output */
+void io_write_byte(io_t* io, uint8_t byte);
+
+/* Read up to count bytes into words, waiting only if no input is
+ * buffered; return the number of bytes read, 0 at end of file */
+long io_read_bytes(io_t* io, uvalue_t* words, size_t count,
+                   byte_format_t format);
+
+/* Write the bytes stored in count words */
+void io_write_bytes(io_t* io, const uvalue_t* words, size_t count,
+                    byte_format_t format);
+
+/* Write all buffered output */
+void io_flush(io_t* io);
+
+#endif // IO_H
@@ -1,29 +1,90 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <stdalign.h>
-#include <assert.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <unistd.h>
 
 #include "memory.h"
 #include "engine.h"
+#include "program.h"
+#include "optimizer.h"
+#include "bench.h"
+#include "batch.h"
+#include "server.h"
+#include "snapshot.h"
 #include "fail.h"
+#include "perf_counters.h"
+#include "io.h"
 
 typedef struct {
   size_t memory_size;
   char* file_name;
+  char* dump_file_name;
+  uvalue_t dump_every_n_gcs;
+  bool perf_counters;
+  bool optimize;
+  bool dedup_strings;
+  bool writer_thread;
+  unsigned int bench_runs;
+  unsigned int bench_warmup_runs;
+  char* input_file_name;
+  char* jobs_file_name;
+  unsigned int threads;
+  uint64_t quantum;
+  char* socket_path;
+  unsigned int workers;
+  char* snapshot_file_name;
+  char* restore_file_name;
 } options_t;
 
-static options_t default_options = { 1000000, NULL };
+static options_t default_options = {
+  1000000, NULL, NULL, 0, false, false, false, false, 0, 1, NULL, NULL, 0, 0, NULL, 0,
+  NULL, NULL
+};
 
 // Argument parsing
 
 static void display_usage(char* prog_name) {
   printf("Usage: %s [<options>] <asm_file>\n", prog_name);
   printf("\noptions:\n");
+  printf("  -b <n>     benchmark: run the program <n> times in-process and"
+         " print\n"
+         "             timing statistics as JSON\n");
+  printf("  -B <n>     number of warm-up runs before benchmarking"
+         " (default %u)\n", default_options.bench_warmup_runs);
+  printf("  -c <file>  write a snapshot of the program to <file> when it first"
+         " reads\n"
+         "             its input, and exit\n");
+  printf("  -d <file>  dump the heap to <file>.<n> on allocation failure"
+         " and on SIGUSR1\n");
+  printf("  -D <n>     also dump the heap every <n> collections\n");
   printf("  -h         display this help message and exit\n");
+  printf("  -i <file>  benchmark: read the standard input from <file>\n");
+  printf("  -j <n>     batch: number of threads running jobs"
+         " (default: one per processor)\n");
+  printf("  -l <file>  batch: run the jobs listed in <file>, each line being\n"
+         "             [<asm_file>] <input_file> <output_file>\n");
   printf("  -m <size>  set memory size in bytes (default %zd)\n",
          default_options.memory_size);
+  printf("  -O         optimize the code after loading it, printing what was"
+         " done\n"
+         "             unless running a batch, a server or a benchmark\n");
+  printf("  -p         print hardware performance counters per phase at exit\n");
+  printf("  -q <n>     batch: run the jobs of each thread as green threads,"
+         " switching\n"
+         "             every <n> backward jumps or calls\n");
+  printf("  -r <file>  resume the program from the snapshot <file> instead of"
+         " loading\n"
+         "             an assembly file\n");
+  printf("  -s <path>  server: run a job for every connection to the Unix"
+         " socket <path>\n");
+  printf("  -t         write the output from a background thread\n");
+  printf("  -u         deduplicate the strings during collections\n");
   printf("  -v         display version and exit\n");
+  printf("  -w <n>     server: serve from <n> preforked worker processes\n");
 }
 
 static void parse_args(int argc, char* argv[], options_t* opts) {
@@ -42,6 +103,118 @@ static void parse_args(int argc, char* argv[], options_t* opts) {
         opts->memory_size = strtoul(argv[i++], NULL, 10);
       } break;
 
+      case 'b': {
+        if (i >= argc) {
+          display_usage(argv[0]);
+          fail("missing argument to -b");
+        }
+        opts->bench_runs = (unsigned int)strtoul(argv[i++], NULL, 10);
+      } break;
+
+      case 'B': {
+        if (i >= argc) {
+          display_usage(argv[0]);
+          fail("missing argument to -B");
+        }
+        opts->bench_warmup_runs = (unsigned int)strtoul(argv[i++], NULL, 10);
+      } break;
+
+      case 'c': {
+        if (i >= argc) {
+          display_usage(argv[0]);
+          fail("missing argument to -c");
+        }
+        opts->snapshot_file_name = argv[i++];
+      } break;
+
+      case 'r': {
+        if (i >= argc) {
+          display_usage(argv[0]);
+          fail("missing argument to -r");
+        }
+        opts->restore_file_name = argv[i++];
+      } break;
+
+      case 'd': {
+        if (i >= argc) {
+          display_usage(argv[0]);
+          fail("missing argument to -d");
+        }
+        opts->dump_file_name = argv[i++];
+      } break;
+
+      case 'D': {
+        if (i >= argc) {
+          display_usage(argv[0]);
+          fail("missing argument to -D");
+        }
+        opts->dump_every_n_gcs = (uvalue_t)strtoul(argv[i++], NULL, 10);
+      } break;
+
+      case 'p': {
+        opts->perf_counters = true;
+      } break;
+
+      case 'O': {
+        opts->optimize = true;
+      } break;
+
+      case 'i': {
+        if (i >= argc) {
+          display_usage(argv[0]);
+          fail("missing argument to -i");
+        }
+        opts->input_file_name = argv[i++];
+      } break;
+
+      case 'j': {
+        if (i >= argc) {
+          display_usage(argv[0]);
+          fail("missing argument to -j");
+        }
+        opts->threads = (unsigned int)strtoul(argv[i++], NULL, 10);
+      } break;
+
+      case 'l': {
+        if (i >= argc) {
+          display_usage(argv[0]);
+          fail("missing argument to -l");
+        }
+        opts->jobs_file_name = argv[i++];
+      } break;
+
+      case 'q': {
+        if (i >= argc) {
+          display_usage(argv[0]);
+          fail("missing argument to -q");
+        }
+        opts->quantum = (uint64_t)strtoull(argv[i++], NULL, 10);
+      } break;
+
+      case 's': {
+        if (i >= argc) {
+          display_usage(argv[0]);
+          fail("missing argument to -s");
+        }
+        opts->socket_path = argv[i++];
+      } break;
+
+      case 'w': {
+        if (i >= argc) {
+          display_usage(argv[0]);
+          fail("missing argument to -w");
+        }
+        opts->workers = (unsigned int)strtoul(argv[i++], NULL, 10);
+      } break;
+
+      case 't': {
+        opts->writer_thread = true;
+      } break;
+
+      case 'u': {
+        opts->dedup_strings = true;
+      } break;
+
       case 'h': {
         display_usage(argv[0]);
         exit(0);
@@ -62,62 +235,117 @@ static void parse_args(int argc, char* argv[], options_t* opts) {
   }
 }
 
-// Memory/size alignment
+// Heap dump on signal
 
-static size_t align_down(size_t value, size_t align) {
-  assert(align > 0 && (align & (align - 1)) == 0); /* check power of 2 */
-  return value & ~(align - 1);
+static void handle_dump_signal(int signal_number) {
+  (void)signal_number;
+  memory_request_dump();
 }
 
-static void* align_up(void* address, size_t align) {
-  assert(align > 0 && (align & (align - 1)) == 0); /* check power of 2 */
-  uintptr_t int_address = (uintptr_t)address;
-  uintptr_t aligned_address = (int_address + align - 1) & ~(align - 1);
-  return (void*)aligned_address;
-}
-
-// ASM file loading
-
-static void load_file(char* file_name, instr_t** instr_ptr) {
-  FILE* file = fopen(file_name, "r");
-  if (file == NULL)
-    fail("cannot open file %s", file_name);
+// Loading
 
-  char line[1000];
-  while (fgets(line, sizeof(line), file) != NULL) {
-    instr_t instr;
-    int read_count = sscanf(line, "%8x", &instr);
-    if (read_count != 1)
-      fail("error while reading file %s", file_name);
-
-    engine_emit(instr, instr_ptr);
+static void load_program(vm_context_t* vm, const options_t* options) {
+  program_load(vm, options->file_name, options->memory_size);
+  if (options->optimize) {
+    optimizer_stats_t optimizer_stats;
+    optimizer_run(vm, &optimizer_stats);
+    optimizer_report(&optimizer_stats, stderr);
   }
-
-  fclose(file);
 }
 
 int main(int argc, char* argv[]) {
   options_t options = default_options;
   parse_args(argc, argv, &options);
-  if (options.file_name == NULL) {
+  if (options.file_name == NULL && options.jobs_file_name == NULL
+      && options.restore_file_name == NULL) {
     display_usage(argv[0]);
     fail("missing input file name");
   }
   if (options.memory_size == 0)
     fail("invalid memory size %zd", options.memory_size);
+  if (options.dump_every_n_gcs > 0 && options.dump_file_name == NULL)
+    fail("option -D requires a dump file (option -d)");
 
-  const int value_align = alignof(value_t);
+  memory_set_dedup_strings(options.dedup_strings);
+  if (options.dump_file_name != NULL) {
+    memory_set_dump(options.dump_file_name, options.dump_every_n_gcs);
+    signal(SIGUSR1, handle_dump_signal);
+  }
+
+  if ((options.snapshot_file_name != NULL || options.restore_file_name != NULL)
+      && (options.socket_path != NULL || options.jobs_file_name != NULL
+          || options.bench_runs > 0))
+    fail("options -c and -r cannot be used with -s, -l and -b");
+  if (options.snapshot_file_name != NULL && options.restore_file_name != NULL)
+    fail("options -c and -r cannot be used together");
+  if (options.optimize && options.restore_file_name != NULL)
+    fail("option -O cannot be used with -r, the snapshot holds the code");
+
+  if (options.quantum > 0 && options.jobs_file_name == NULL)
+    fail("option -q requires a jobs file (option -l)");
+  if (options.workers > 0 && options.socket_path == NULL)
+    fail("option -w requires a socket (option -s)");
+
+  if (options.socket_path != NULL) {
+    if (options.jobs_file_name != NULL || options.bench_runs > 0
+        || options.perf_counters)
+      fail("options -l, -b and -p cannot be used with -s");
+    server_options_t server_options = {
+      options.socket_path, options.file_name, options.memory_size,
+      options.workers, options.optimize, options.writer_thread
+    };
+    server_run(&server_options);
+    return 0;
+  }
 
-  memory_setup(align_down(options.memory_size, value_align));
-  engine_setup();
+  if (options.jobs_file_name != NULL) {
+    if (options.bench_runs > 0 || options.perf_counters)
+      fail("options -b and -p cannot be used with -l");
+    batch_options_t batch_options = {
+      options.jobs_file_name, options.file_name, options.memory_size,
+      options.threads, options.quantum, options.optimize,
+      options.writer_thread
+    };
+    return batch_run(&batch_options) == 0 ? 0 : 1;
+  }
+
+  if (options.bench_runs > 0) {
+    if (options.perf_counters)
+      fail("options -b and -p cannot be used together");
+    bench_options_t bench_options = {
+      options.file_name, options.input_file_name, options.memory_size,
+      options.bench_runs, options.bench_warmup_runs, options.optimize
+    };
+    bench_run(&bench_options);
+    return 0;
+  }
+
+  vm_context_t vm = { 0 };
+  if (options.snapshot_file_name != NULL) {
+    load_program(&vm, &options);
+    snapshot_create(&vm, options.snapshot_file_name);
+    program_unload(&vm);
+    return 0;
+  }
 
-  instr_t* instr_ptr = memory_get_start();
-  load_file(options.file_name, &instr_ptr);
-  memory_set_heap_start(align_up(instr_ptr, value_align));
-  uvalue_t halt_code = engine_run();
+  if (options.perf_counters && !perf_counters_setup())
+    fprintf(stderr, "warning: hardware performance counters unavailable\n");
+  vm.io = io_setup(STDIN_FILENO, STDOUT_FILENO, options.writer_thread);
+  io_flush_on_fail(vm.io);
+  if (options.restore_file_name != NULL)
+    snapshot_restore(&vm, options.restore_file_name);
+  else
+    load_program(&vm, &options);
+  perf_counters_enter(perf_phase_INTERPRETER);
+  uvalue_t halt_code = options.restore_file_name != NULL
+    ? engine_continue(&vm)
+    : engine_run(&vm);
+  perf_counters_enter(perf_phase_NONE);
+  io_cleanup(vm.io);
+  perf_counters_report(stderr);
+  perf_counters_cleanup();
 
-  engine_cleanup();
-  memory_cleanup();
+  program_unload(&vm);
 
   return (int)halt_code;
 }
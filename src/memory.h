@@ -1,8 +1,11 @@
 #ifndef MEMORY_H
 #define MEMORY_H
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include "vmtypes.h"
+#include "vm_context.h"
 
 typedef enum {
   tag_String = 200,
@@ -11,26 +14,66 @@ typedef enum {
   tag_None = 255
 } tag_t;
 
+typedef struct {
+  uvalue_t gc_count;            /* number of collections */
+  double gc_seconds;            /* time spent collecting */
+  size_t live_bytes;            /* heap in use after the last collection */
+  uvalue_t strings_deduplicated; /* references moved to an equal string */
+} memory_stats_t;
+
 /* Returns a string identifying the memory system */
 char* memory_get_identity(void);
 
-/* Setup the memory allocator and garbage collector */
-void memory_setup(size_t total_size);
+/* Setup the memory allocator and garbage collector of vm */
+void memory_setup(vm_context_t* vm, size_t total_size);
 
 /* Tear down the memory */
-void memory_cleanup(void);
+void memory_cleanup(vm_context_t* vm);
 
 /* Get first memory address */
-void* memory_get_start(void);
+void* memory_get_start(vm_context_t* vm);
 
 /* Get last memory address */
-void* memory_get_end(void);
+void* memory_get_end(vm_context_t* vm);
 
 /* Set the heap start, following the code area */
-void memory_set_heap_start(void* heap_start);
+void memory_set_heap_start(vm_context_t* vm, void* heap_start);
+
+/* Free all the blocks of the heap and reset the statistics, leaving the
+ * code area untouched; only the part of the heap used since the heap
+ * start was set or last reset is cleared */
+void memory_reset(vm_context_t* vm);
+
+/* Write the allocator state and the memory area of vm to a snapshot
+ * file (see snapshot.h) */
+void memory_save(vm_context_t* vm, FILE* file);
+
+/* Setup the memory of vm from what memory_save wrote at the current
+ * position of file, mapping the memory area copy-on-write */
+void memory_restore(vm_context_t* vm, FILE* file);
 
 /* Allocate block, return physical pointer to the new block */
-uvalue_t* memory_allocate(tag_t tag, uvalue_t size);
+uvalue_t* memory_allocate(vm_context_t* vm, tag_t tag, uvalue_t size);
+
+/* Get the collection statistics since the memory was setup */
+void memory_get_stats(vm_context_t* vm, memory_stats_t* stats);
+
+/* Dump the heap to files named <file_name>.<n> when an allocation fails
+ * and, if every_n_gcs is not 0, every every_n_gcs collections; this
+ * setting applies to all the VMs of the process */
+void memory_set_dump(char* file_name, uvalue_t every_n_gcs);
+
+/* Deduplicate strings during collections: every reference to a string
+ * is moved to the first reached string with the same characters, and the
+ * other copies are freed. Only the strings whose words are all characters
+ * are deduplicated, which assumes that a program never writes a string
+ * after having written all its characters, as code compiled from L3 does;
+ * this setting applies to all the VMs of the process */
+void memory_set_dedup_strings(bool dedup);
+
+/* Request a heap dump at the next allocation of any VM
+ * (async-signal-safe) */
+void memory_request_dump(void);
 
 /* Unpack block size from a physical pointer */
 uvalue_t memory_get_block_size(uvalue_t* block);
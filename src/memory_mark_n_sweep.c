@@ -1,39 +1,125 @@
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
 #include <stdbool.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
 
 #include "memory.h"
 #include "fail.h"
 #include "engine.h"
+#include "heap_dump.h"
+#include "perf_counters.h"
+#include "timer.h"
+#include "snapshot.h"
+#ifdef ALLOC_PROFILE
+#include "alloc_profile.h"
+#endif
 
 #define HEADER_SIZE 1
 
-static uvalue_t *memory_start = NULL;
-static uvalue_t *memory_end = NULL;
+// The heap is made of pages aligned on their size, each one starting with
+// a header. A small page holds blocks of a single size and tag, given by
+// its header, which have no header of their own (big bag of pages). A
+// large block takes a run of pages, and the header of its first page is
+// its own. Either way, the header of a block is the first word of the
+// page holding the word before it.
+#define PAGE_BYTES 1024
+#define PAGE_WORDS ((uvalue_t)(PAGE_BYTES / sizeof(uvalue_t)))
 
-static uvalue_t *heap_start = NULL;
-static uvalue_t *bitmap_start = NULL;
+// largest block of a small page, which holds at least two of them
+#define SMALL_MAX ((PAGE_WORDS - HEADER_SIZE) / 2)
 
+// runs of free pages are kept in free lists by number of pages
 #define FL_SIZE 32
-static uvalue_t *FL[FL_SIZE] = {NULL};
 
-#ifdef GC_STATS
-static uvalue_t gc_count = 0;
+// initial capacity of the size class table, a power of 2
+#define CLASSES_MIN_CAPACITY 64
+
+// size class table entry not in use, the header of no small block
+#define CLASS_NONE UINT32_MAX
+
+// initial capacity of the string deduplication table, a power of 2
+#define STRINGS_MIN_CAPACITY 1024
+
+// L3 characters, as written by io.c
+#define CHAR_SHIFT 3
+#define CHAR_TAG 6
+
+#ifdef ALLOC_PROFILE
+#define PROFILE_TOP_SITES 20
 #endif
 
+// free blocks of the small pages with a given header
+typedef struct {
+    uvalue_t header;
+    uvalue_t *free;
+} size_class_t;
+
+struct memory {
+    uvalue_t *memory_start;
+    uvalue_t *memory_end;
+
+    uvalue_t *heap_start;
+    uvalue_t *heap_end;
+    // one bit per heap word, set at the start of allocated blocks
+    uvalue_t *bitmap_start;
+    // likewise, set at the start of the blocks reached by the mark phase
+    uvalue_t *mark_bitmap_start;
+    // end of the highest page allocated since the heap was (re)initialized
+    uvalue_t *heap_top;
+
+    uvalue_t *FL[FL_SIZE];
+
+    // size classes of the small pages, by header (open addressing)
+    size_class_t *classes;
+    uvalue_t classes_capacity;
+    uvalue_t classes_count;
+
+    uvalue_t gc_count;
+    double gc_seconds;
+    // words of the blocks that survived the last collection, headers included
+    uvalue_t live_words;
+    uvalue_t strings_deduplicated;
+
+    // canonical strings of the collection in progress, by content
+    // (open addressing); NULL when strings are not being deduplicated
+    uvalue_t **strings;
+    uvalue_t strings_capacity;
+    uvalue_t strings_count;
+
+    #ifdef ALLOC_PROFILE
+    // allocation site of each block, indexed like the bitmap
+    uvalue_t *site_map;
+    alloc_profile_t *profile;
+    #endif
+};
+
+// heap dumps, shared by all VMs: file name prefix, period in GCs,
+// sequence number of the next file, pending signal request
+static char *dump_file_name = NULL;
+static uvalue_t dump_every_n_gcs = 0;
+static _Atomic uvalue_t dump_seq = 0;
+static volatile sig_atomic_t dump_requested = 0;
+
+// string deduplication, shared by all VMs
+static bool dedup_strings = false;
+
 /*************************************
  * UTILS
  *************************************/
 
-static inline void *addr_v_to_p(uvalue_t v_addr){
-    return (char *)memory_start + v_addr;
+static inline void *addr_v_to_p(memory_t *m, uvalue_t v_addr){
+    return (char *)m->memory_start + v_addr;
 }
 
-static inline uvalue_t addr_p_to_v(void *p_addr){
-    return (uvalue_t)((char *)p_addr - (char *)memory_start);
+static inline uvalue_t addr_p_to_v(memory_t *m, void *p_addr){
+    return (uvalue_t)((char *)p_addr - (char *)m->memory_start);
 }
 
 static inline uvalue_t header_pack(tag_t tag, uvalue_t size){
@@ -48,8 +134,12 @@ static inline uvalue_t header_unpack_size(uvalue_t header){
     return header >> (uint8_t)8;
 }
 
+static inline uvalue_t *page_of(uvalue_t *block){
+    return (uvalue_t *)((uintptr_t)(block - HEADER_SIZE) & ~(uintptr_t)(PAGE_BYTES - 1));
+}
+
 static inline uvalue_t get_block_size(uvalue_t *block){
-    return header_unpack_size(block[-HEADER_SIZE]);
+    return header_unpack_size(*page_of(block));
 }
 
 static inline uvalue_t real_size(uvalue_t size){
@@ -57,65 +147,104 @@ static inline uvalue_t real_size(uvalue_t size){
 }
 
 static inline tag_t get_block_tag(uvalue_t *block){
-    return header_unpack_tag(block[-HEADER_SIZE]);
+    return header_unpack_tag(*page_of(block));
+}
+
+static inline bool is_small(uvalue_t size){
+    return size <= SMALL_MAX;
+}
+
+// number of blocks of a small page
+static inline uvalue_t page_slots(uvalue_t size){
+    return (PAGE_WORDS - HEADER_SIZE) / real_size(size);
+}
+
+// number of pages of a large block
+static inline uvalue_t run_pages(uvalue_t size){
+    return (size + HEADER_SIZE + PAGE_WORDS - 1) / PAGE_WORDS;
+}
+
+// number of pages starting at page, which is free, small or large
+static inline uvalue_t page_count(uvalue_t *page){
+    uvalue_t size = header_unpack_size(page[0]);
+    if (header_unpack_tag(page[0]) == tag_None)
+        return size;
+    return is_small(size) ? 1 : run_pages(size);
+}
+
+// heap words used by a block, its share of the page header excluded
+static inline uvalue_t block_words(uvalue_t size){
+    return is_small(size) ? real_size(size) : size + HEADER_SIZE;
 }
 
 /*************************************
  * BITMAP
  *************************************/
 
-static inline void bm_set(uvalue_t *block){
-    uvalue_t bytes = (uvalue_t)(block - heap_start);
+static inline void bm_set(memory_t *m, uvalue_t *bitmap, uvalue_t *block){
+    uvalue_t bytes = (uvalue_t)(block - m->heap_start);
     uvalue_t index = bytes / VALUE_BITS;
     uvalue_t mask = ((uvalue_t)1) << (bytes % VALUE_BITS);
-    bitmap_start[index] |= mask;
+    bitmap[index] |= mask;
 }
 
-static inline void bm_clear(uvalue_t *block){
-    uvalue_t bytes = (uvalue_t)(block - heap_start);
+static inline void bm_clear(memory_t *m, uvalue_t *bitmap, uvalue_t *block){
+    uvalue_t bytes = (uvalue_t)(block - m->heap_start);
     uvalue_t index = bytes / VALUE_BITS;
     uvalue_t mask = ~(((uvalue_t)1) << (bytes % VALUE_BITS));
-    bitmap_start[index] &= mask;
+    bitmap[index] &= mask;
 }
 
-static inline int bm_is_set(uvalue_t *block){
-    uvalue_t bytes = (uvalue_t)(block - heap_start);
+static inline int bm_is_set(memory_t *m, uvalue_t *bitmap, uvalue_t *block){
+    uvalue_t bytes = (uvalue_t)(block - m->heap_start);
     uvalue_t index = bytes / VALUE_BITS;
     uvalue_t mask = ((uvalue_t)1) << (bytes % VALUE_BITS);
-    return (bitmap_start[index] & mask) != 0;
+    return (bitmap[index] & mask) != 0;
+}
+
+// Is p the start of an allocated block not marked yet?
+static inline bool is_unmarked_block(memory_t *m, uvalue_t *p){
+    return p > m->heap_start && p < m->heap_end
+        && bm_is_set(m, m->bitmap_start, p)
+        && !bm_is_set(m, m->mark_bitmap_start, p);
 }
 
 /*************************************
  * FREE LISTS
  *************************************/
 
-static inline void list_init(){
+// The elements of the free lists of page runs are the words following
+// the header of their first page, which holds their number of pages, as
+// if they were blocks. The elements of the free lists of size classes are
+// free blocks of small pages.
+
+static inline void list_init(memory_t *m){
     for (size_t i = 0; i < FL_SIZE; i++){
-        FL[i] = memory_start;
+        m->FL[i] = m->memory_start;
     }
 }
 
-static inline uvalue_t *list_next(const uvalue_t *element){
-    return addr_v_to_p(element[0]);
+static inline uvalue_t *list_next(memory_t *m, const uvalue_t *element){
+    return addr_v_to_p(m, element[0]);
 }
 
-static inline void list_remove_next(uvalue_t *element){
-    if (element != memory_start){
-        uvalue_t *next = list_next(element);
-        if (next != memory_start){
-            element[0] = addr_p_to_v(list_next(next));
+static inline void list_remove_next(memory_t *m, uvalue_t *element){
+    if (element != m->memory_start){
+        uvalue_t *next = list_next(m, element);
+        if (next != m->memory_start){
+            element[0] = addr_p_to_v(m, list_next(m, next));
             next[0] = 0;
         }
     }
 }
 
-static inline void list_prepend(int idx, uvalue_t *element){
-    element[0] = addr_p_to_v(FL[idx]);
-    FL[idx] = element;
+static inline void list_prepend(memory_t *m, int idx, uvalue_t *element){
+    element[0] = addr_p_to_v(m, m->FL[idx]);
+    m->FL[idx] = element;
 }
 
-static inline void list_remove_head(int idx){
-    FL[idx] = list_next(FL[idx]);
+static inline void list_remove_head(memory_t *m, int idx){
+    m->FL[idx] = list_next(m, m->FL[idx]);
 }
 
 static inline int list_idx(uvalue_t size){
@@ -123,175 +252,590 @@ static inline int list_idx(uvalue_t size){
     return idx < FL_SIZE ? idx : FL_SIZE - 1;
 }
 
+/*************************************
+ * Size classes
+ *************************************/
+
+static void classes_clear(memory_t *m){
+    for (uvalue_t i = 0; i < m->classes_capacity; i++){
+        m->classes[i].header = CLASS_NONE;
+        m->classes[i].free = m->memory_start;
+    }
+    m->classes_count = 0;
+}
+
+static void classes_setup(memory_t *m, uvalue_t capacity){
+    m->classes = malloc(capacity * sizeof(size_class_t));
+    if (m->classes == NULL)
+        fail("cannot allocate size class table");
+    m->classes_capacity = capacity;
+    classes_clear(m);
+}
+
+static size_class_t *class_get(memory_t *m, uvalue_t header);
+
+static void classes_grow(memory_t *m){
+    size_class_t *old = m->classes;
+    uvalue_t old_capacity = m->classes_capacity;
+
+    classes_setup(m, old_capacity * 2);
+    for (uvalue_t i = 0; i < old_capacity; i++){
+        if (old[i].header != CLASS_NONE)
+            class_get(m, old[i].header)->free = old[i].free;
+    }
+    free(old);
+}
+
+// Return the size class of the blocks with the given header, adding it
+// if needed
+static size_class_t *class_get(memory_t *m, uvalue_t header){
+    uvalue_t mask = m->classes_capacity - 1;
+    uvalue_t i = ((header * 2654435761u) >> 16) & mask;
+    while (m->classes[i].header != header){
+        if (m->classes[i].header == CLASS_NONE){
+            if (2 * (m->classes_count + 1) > m->classes_capacity){
+                classes_grow(m);
+                return class_get(m, header);
+            }
+            m->classes[i].header = header;
+            m->classes_count++;
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return &m->classes[i];
+}
+
+// Prepend the free blocks of a small page to the free list of its size
+// class, in address order
+static void class_link_free(memory_t *m, size_class_t *class, uvalue_t *page){
+    uvalue_t size = real_size(header_unpack_size(page[0]));
+    for (uvalue_t i = page_slots(size); i-- > 0;){
+        uvalue_t *block = page + HEADER_SIZE + i * size;
+        if (!bm_is_set(m, m->bitmap_start, block)){
+            block[0] = addr_p_to_v(m, class->free);
+            class->free = block;
+        }
+    }
+}
+
+/*************************************
+ * String deduplication
+ *************************************/
+
+// Hash the characters of a string. Return false if one of its words is
+// not a character: the string is still being built, and may be written.
+// The L3 compiler writes the characters of a string right after
+// allocating it and never afterwards, so a complete string is immutable.
+static bool string_hash(uvalue_t *string, uvalue_t *hash){
+    uvalue_t size = get_block_size(string);
+    uvalue_t h = 2166136261u ^ size;
+    for (uvalue_t i = 0; i < size; ++i){
+        if ((string[i] & ((1 << CHAR_SHIFT) - 1)) != CHAR_TAG)
+            return false;
+        h = (h ^ string[i]) * 16777619u;
+    }
+    // the low bits index the table, mix the high ones in
+    *hash = h ^ (h >> 16);
+    return true;
+}
+
+static bool string_equals(uvalue_t *s1, uvalue_t *s2){
+    uvalue_t size = get_block_size(s1);
+    return size == get_block_size(s2)
+        && memcmp(s1, s2, size * sizeof(uvalue_t)) == 0;
+}
+
+static void strings_insert(memory_t *m, uvalue_t *string, uvalue_t hash){
+    uvalue_t mask = m->strings_capacity - 1;
+    uvalue_t i = hash & mask;
+    while (m->strings[i] != NULL){
+        i = (i + 1) & mask;
+    }
+    m->strings[i] = string;
+    m->strings_count++;
+}
+
+static void strings_grow(memory_t *m){
+    uvalue_t **old = m->strings;
+    uvalue_t old_capacity = m->strings_capacity;
+
+    // keep the table consistent if the allocation fails
+    uvalue_t **strings = calloc(old_capacity * 2, sizeof(uvalue_t *));
+    if (strings == NULL)
+        fail("cannot allocate string deduplication table");
+    m->strings = strings;
+    m->strings_capacity = old_capacity * 2;
+    m->strings_count = 0;
+    for (uvalue_t i = 0; i < old_capacity; ++i){
+        uvalue_t hash;
+        if (old[i] != NULL && string_hash(old[i], &hash))
+            strings_insert(m, old[i], hash);
+    }
+    free(old);
+}
+
+// Return the canonical copy of the block about to be marked: the first
+// reached string with the same characters, or the block itself
+static uvalue_t *string_canonical(memory_t *m, uvalue_t *block){
+    uvalue_t hash;
+    if (get_block_tag(block) != tag_String || !string_hash(block, &hash))
+        return block;
+
+    uvalue_t mask = m->strings_capacity - 1;
+    for (uvalue_t i = hash & mask; m->strings[i] != NULL; i = (i + 1) & mask){
+        if (string_equals(m->strings[i], block)){
+            m->strings_deduplicated++;
+            return m->strings[i];
+        }
+    }
+
+    if (2 * (m->strings_count + 1) > m->strings_capacity)
+        strings_grow(m);
+    strings_insert(m, block, hash);
+    return block;
+}
+
+static void strings_end(memory_t *m){
+    if (m->strings_count > 0){
+        memset(m->strings, 0, m->strings_capacity * sizeof(uvalue_t *));
+        m->strings_count = 0;
+    }
+}
+
+static void strings_begin(memory_t *m){
+    if (m->strings_capacity == 0){
+        uvalue_t **strings = calloc(STRINGS_MIN_CAPACITY, sizeof(uvalue_t *));
+        if (strings == NULL)
+            fail("cannot allocate string deduplication table");
+        m->strings = strings;
+        m->strings_capacity = STRINGS_MIN_CAPACITY;
+    }
+    // a collection interrupted by fail did not forget its strings
+    strings_end(m);
+}
+
+
 /*************************************
  *  Marking
  *************************************/
 
-static void rec_mark(uvalue_t *root){
-    if (root > heap_start && root <= memory_end && bm_is_set(root)){
-        bm_clear(root);
+static void rec_mark(memory_t *m, uvalue_t *root, bool dedup){
+    if (is_unmarked_block(m, root)){
+        bm_set(m, m->mark_bitmap_start, root);
 
         uvalue_t blocksize = get_block_size(root);
         for (uvalue_t i = 0; i < blocksize; ++i){
             if (root[i] != 0 && (root[i] & 3) == 0){
-                rec_mark(addr_v_to_p(root[i]));
+                uvalue_t *child = addr_v_to_p(m, root[i]);
+                if (dedup && is_unmarked_block(m, child)){
+                    // a duplicate string is not marked, it is swept once
+                    // all its references point to the canonical copy
+                    uvalue_t *canonical = string_canonical(m, child);
+                    if (canonical != child){
+                        root[i] = addr_p_to_v(m, canonical);
+                        continue;
+                    }
+                }
+                rec_mark(m, child, dedup);
             }
         }
     }
 }
 
-static void mark(){
-    rec_mark(engine_get_Ib());
-    rec_mark(engine_get_Lb());
-    rec_mark(engine_get_Ob());
+static void mark_roots(vm_context_t *vm, bool dedup){
+    rec_mark(vm->memory, engine_get_Ib(vm), dedup);
+    rec_mark(vm->memory, engine_get_Lb(vm), dedup);
+    rec_mark(vm->memory, engine_get_Ob(vm), dedup);
+}
 
-    #ifdef GC_STATS
-    gc_count++;
-    #endif
+static void mark(vm_context_t *vm){
+    memory_t *m = vm->memory;
+    if (dedup_strings){
+        strings_begin(m);
+        mark_roots(vm, true);
+        strings_end(m);
+    }else{
+        mark_roots(vm, false);
+    }
+
+    m->gc_count++;
 }
 
 /*************************************
  * Sweeping & coalescing
  *************************************/
-static inline uvalue_t coalesce(uvalue_t* start_free, uvalue_t* current, uvalue_t cur_size){
-    current[-HEADER_SIZE] = 0;
-    if (cur_size > 0)
-        current[0] = 0;
-
-    // update size of new free block
-    uvalue_t free_size = (uvalue_t)(current - start_free) + cur_size;
-    start_free[-HEADER_SIZE] = header_pack(tag_None, free_size);
 
-    return free_size;
+// Free the unmarked blocks of a small page, return its number of live
+// blocks
+static uvalue_t sweep_small_page(memory_t *m, uvalue_t *page){
+    uvalue_t size = real_size(header_unpack_size(page[0]));
+    uvalue_t live = 0;
+    uvalue_t *block = page + HEADER_SIZE;
+    for (uvalue_t i = page_slots(size); i > 0; --i, block += size){
+        if (!bm_is_set(m, m->bitmap_start, block))
+            continue;
+
+        if (bm_is_set(m, m->mark_bitmap_start, block)){
+            bm_clear(m, m->mark_bitmap_start, block);
+            live++;
+            #ifdef ALLOC_PROFILE
+            alloc_profile_survived(m->profile, m->site_map[block - m->heap_start]);
+            #endif
+        }else{
+            // block is not reachable --> free it
+            bm_clear(m, m->bitmap_start, block);
+            #ifdef ALLOC_PROFILE
+            alloc_profile_died(m->profile, m->site_map[block - m->heap_start]);
+            #endif
+            memset(block, 0, size * sizeof(uvalue_t));
+        }
+    }
+    m->live_words += live * size;
+    return live;
 }
 
-static void sweep(){
-    list_init();
+// Free the large block of a run of pages if it is unmarked, return
+// whether it is live
+static bool sweep_large_block(memory_t *m, uvalue_t *page, uvalue_t pages){
+    uvalue_t *block = page + HEADER_SIZE;
+    #ifdef ALLOC_PROFILE
+    uvalue_t site = m->site_map[block - m->heap_start];
+    #endif
+    if (bm_is_set(m, m->mark_bitmap_start, block)){
+        bm_clear(m, m->mark_bitmap_start, block);
+        m->live_words += get_block_size(block) + HEADER_SIZE;
+        #ifdef ALLOC_PROFILE
+        alloc_profile_survived(m->profile, site);
+        #endif
+        return true;
+    }
 
-    uvalue_t *start_free = heap_start + HEADER_SIZE;
-    uvalue_t *current = start_free;
-    int last_list = -1;
+    bm_clear(m, m->bitmap_start, block);
+    #ifdef ALLOC_PROFILE
+    alloc_profile_died(m->profile, site);
+    #endif
+    memset(page, 0, pages * PAGE_BYTES);
+    return false;
+}
 
-    while (current <= memory_end){
-        uvalue_t current_size = get_block_size(current);
+// Make the pages from first to end a run of free pages
+static void run_free(memory_t *m, uvalue_t *first, uvalue_t *end){
+    uvalue_t pages = (uvalue_t)(end - first) / PAGE_WORDS;
+    first[0] = header_pack(tag_None, pages);
+    list_prepend(m, list_idx(pages), first + HEADER_SIZE);
+}
 
-        if (bm_is_set(current)){
-            // block is not reachable --> free it
-            bm_clear(current);
-            current_size = real_size(current_size);
-            memset(current, 0, current_size * sizeof(uvalue_t));
-            current[-HEADER_SIZE] = header_pack(tag_None, current_size);
+static void sweep(memory_t *m){
+    list_init(m);
+    for (uvalue_t i = 0; i < m->classes_capacity; i++){
+        m->classes[i].free = m->memory_start;
+    }
+    m->live_words = 0;
+
+    // first page of the run of free pages being coalesced
+    uvalue_t *free_run = NULL;
+    uvalue_t *page = m->heap_start;
+    while (page < m->heap_end){
+        uvalue_t header = page[0];
+        uvalue_t pages = page_count(page);
+        bool is_free;
+
+        if (header_unpack_tag(header) == tag_None){
+            is_free = true;
+        }else if (is_small(header_unpack_size(header))){
+            is_free = sweep_small_page(m, page) == 0;
+            if (is_free)
+                memset(page, 0, PAGE_BYTES);
+            else
+                class_link_free(m, class_get(m, header), page);
+        }else{
+            is_free = !sweep_large_block(m, page, pages);
         }
 
-        if (get_block_tag(current) == tag_None){
-            // coalesce adjacent free blocks
-            if (start_free < current){
-                current_size = coalesce(start_free, current, current_size);
-                current = start_free;
+        if (is_free){
+            // coalesce adjacent free pages
+            if (free_run == NULL){
+                free_run = page;
+            }else{
+                page[0] = 0;
+                page[HEADER_SIZE] = 0;
             }
+        }else if (free_run != NULL){
+            run_free(m, free_run, page);
+            free_run = NULL;
+        }
 
-            // update free lists
-            int idx = list_idx(current_size);
-            if (idx != last_list){
-                if (last_list != -1){
-                    list_remove_head(last_list);
-                }
-                list_prepend(idx, current);
-                last_list = idx;
-            }
-        }else{ 
-            // the block is not free -> point start_free on next block
-            current_size = real_size(current_size);
-            start_free = current + current_size + HEADER_SIZE;
-            bm_set(current);
-            last_list = -1;
+        page += pages * PAGE_WORDS;
+    }
+    if (free_run != NULL)
+        run_free(m, free_run, page);
+}
+
+// Rebuild the free lists of a heap whose blocks are all allocated or free
+static void heap_relink(memory_t *m){
+    list_init(m);
+    uvalue_t *page = m->heap_start;
+    while (page < m->heap_end){
+        uvalue_t pages = page_count(page);
+        if (header_unpack_tag(page[0]) == tag_None){
+            list_prepend(m, list_idx(pages), page + HEADER_SIZE);
+        }else if (is_small(header_unpack_size(page[0]))){
+            class_link_free(m, class_get(m, page[0]), page);
+        }
+        page += pages * PAGE_WORDS;
+    }
+}
+
+/*************************************
+ * Heap dump
+ *************************************/
+
+static inline bool is_heap_pointer(memory_t *m, uvalue_t value){
+    if (value == 0 || (value & 3) != 0)
+        return false;
+    uvalue_t *target = addr_v_to_p(m, value);
+    return target > m->heap_start && target < m->heap_end;
+}
+
+typedef struct {
+    FILE *file;
+    heap_dump_header_t header;
+    uvalue_t *pointers;
+    uvalue_t pointers_capacity;
+} dump_t;
+
+// Write a block or, if it is not allocated, a free block of size words
+static void dump_block(memory_t *m, dump_t *dump, uvalue_t *block,
+                       uvalue_t size, bool headerless){
+    uvalue_t flags = headerless ? block_flag_HEADERLESS : 0;
+    heap_dump_block_t record = {
+        .address = addr_p_to_v(m, block),
+        .tag = tag_None,
+        .size = size,
+        .flags = flags | block_flag_FREE,
+        .pointer_count = 0
+    };
+
+    if (bm_is_set(m, m->bitmap_start, block)){
+        record.tag = get_block_tag(block);
+        record.size = get_block_size(block);
+        record.flags = flags;
+        if (bm_is_set(m, m->mark_bitmap_start, block)){
+            record.flags |= block_flag_LIVE;
+            bm_clear(m, m->mark_bitmap_start, block);
         }
 
-        current += current_size + HEADER_SIZE;
+        if (dump->pointers_capacity < record.size){
+            dump->pointers_capacity = record.size;
+            dump->pointers = realloc(dump->pointers,
+                                     dump->pointers_capacity * sizeof(uvalue_t));
+            if (dump->pointers == NULL)
+                fail("cannot allocate heap dump buffer");
+        }
+        for (uvalue_t i = 0; i < record.size; ++i){
+            if (is_heap_pointer(m, block[i]))
+                dump->pointers[record.pointer_count++] = block[i];
+        }
     }
+
+    heap_dump_write_block(dump->file, &record, dump->pointers);
+    dump->header.block_count++;
+}
+
+// Walk the pages like sweep() and write every block to a new dump file,
+// a run of free pages being written as one free block. Liveness is
+// computed by marking from the roots, the mark bitmap is cleared
+// afterwards so the dump can happen at any allocation.
+static void heap_dump(vm_context_t *vm, dump_reason_t reason){
+    memory_t *m = vm->memory;
+    char name[FILENAME_MAX];
+    snprintf(name, sizeof(name), "%s.%u", dump_file_name, dump_seq++);
+    dump_t dump = {
+        .file = fopen(name, "wb"),
+        .header = {
+            .magic = HEAP_DUMP_MAGIC,
+            .version = HEAP_DUMP_VERSION,
+            .reason = reason,
+            .gc_count = m->gc_count,
+            .heap_start = addr_p_to_v(m, m->heap_start),
+            .heap_end = addr_p_to_v(m, m->heap_end),
+            .roots = { addr_p_to_v(m, engine_get_Ib(vm)),
+                       addr_p_to_v(m, engine_get_Lb(vm)),
+                       addr_p_to_v(m, engine_get_Ob(vm)) },
+            .block_count = 0
+        },
+        .pointers = NULL,
+        .pointers_capacity = 0
+    };
+    if (dump.file == NULL)
+        fail("cannot open heap dump file %s", name);
+    heap_dump_write_header(dump.file, &dump.header);
+
+    mark_roots(vm, false);
+
+    uvalue_t *page = m->heap_start;
+    while (page < m->heap_end){
+        uvalue_t pages = page_count(page);
+        uvalue_t size = header_unpack_size(page[0]);
+        if (header_unpack_tag(page[0]) == tag_None){
+            dump_block(m, &dump, page + HEADER_SIZE,
+                       pages * PAGE_WORDS - HEADER_SIZE, false);
+        }else if (is_small(size)){
+            size = real_size(size);
+            for (uvalue_t i = 0; i < page_slots(size); ++i){
+                dump_block(m, &dump, page + HEADER_SIZE + i * size, size, true);
+            }
+        }else{
+            dump_block(m, &dump, page + HEADER_SIZE, size, false);
+        }
+        page += pages * PAGE_WORDS;
+    }
+    free(dump.pointers);
+
+    rewind(dump.file);
+    heap_dump_write_header(dump.file, &dump.header);
+    if (fclose(dump.file) != 0)
+        fail("cannot write heap dump file %s", name);
+    fprintf(stderr, "heap dumped to %s\n", name);
+}
+
+void memory_get_stats(vm_context_t *vm, memory_stats_t *stats){
+    stats->gc_count = vm->memory->gc_count;
+    stats->gc_seconds = vm->memory->gc_seconds;
+    stats->live_bytes = vm->memory->live_words * sizeof(uvalue_t);
+    stats->strings_deduplicated = vm->memory->strings_deduplicated;
+}
+
+void memory_set_dump(char *file_name, uvalue_t every_n_gcs){
+    dump_file_name = file_name;
+    dump_every_n_gcs = every_n_gcs;
+}
+
+void memory_set_dedup_strings(bool dedup){
+    dedup_strings = dedup;
+}
+
+void memory_request_dump(){
+    dump_requested = 1;
 }
 
 /*************************************
  * Blocks allocation
  *************************************/
 
-static uvalue_t *block_allocate(tag_t tag, uvalue_t size){
-    uvalue_t realsize = real_size(size);
-    int fl_idx = list_idx(realsize); 
-    for (int idx = fl_idx; idx < FL_SIZE; idx++){
-        #ifdef NO_0_BLOCKS
-        if((fl_idx != FL_SIZE - 2) && (idx == fl_idx + 1)){ continue; }
-        #endif
-
-        uvalue_t *block = FL[idx];
+// Take a run of n free pages, the first that fits in the free lists, and
+// return its first page
+static uvalue_t *run_allocate(memory_t *m, uvalue_t n){
+    for (int idx = list_idx(n); idx < FL_SIZE; idx++){
+        uvalue_t *run = m->FL[idx];
         uvalue_t *prev = NULL;
 
+        while (run != m->memory_start){
+            uvalue_t pages = header_unpack_size(run[-HEADER_SIZE]);
 
-        while (block != memory_start){
-            uvalue_t total_size = get_block_size(block);
-
-            #ifdef NO_0_BLOCKS
-            if (realsize <= total_size && realsize != total_size - 1){
-            #else
-            if (realsize <= total_size){
-            #endif
+            if (n <= pages){
                 // we found a candidate -> remove it from old free list
                 if (prev == NULL){
-                    list_remove_head(idx);
+                    list_remove_head(m, idx);
                 }else{
-                    list_remove_next(prev);
+                    list_remove_next(m, prev);
                 }
 
-                if (realsize < total_size){
-                    // the allocated block is smaller -> split it 
-                    uvalue_t *new_free = block + realsize + HEADER_SIZE;
-                    uvalue_t new_free_size = total_size - realsize - HEADER_SIZE;
-                    new_free[-HEADER_SIZE] = header_pack(tag_None, new_free_size);
-
-                    if (new_free_size > 0){
-                        // Note: if the remaining free size is 0, a tag_None block of size 0
-                        // is created on the heap, I let him alone as it will be coalesced with
-                        // one of the adjacent block when they are collected.
-                        // My tests showed me that this is better (than try to find an another
-                        // block with enough space) in term of performance and often result in an
-                        // out of memory crash happening later (except for the maze program).
-                        // To disable this: build with "make no0blocks"
-                        list_prepend(list_idx(new_free_size), new_free);
-                    }
+                if (n < pages){
+                    // the run is longer -> split it
+                    uvalue_t *rest = run + n * PAGE_WORDS;
+                    rest[-HEADER_SIZE] = header_pack(tag_None, pages - n);
+                    list_prepend(m, list_idx(pages - n), rest);
                 }
 
-                // initilize the new block
-                bm_set(block);
-                block[-HEADER_SIZE] = header_pack(tag, size);
-                block[0] = 0;
-                return block;
+                uvalue_t *page = run - HEADER_SIZE;
+                page[0] = 0;
+                run[0] = 0;
+                if (page + n * PAGE_WORDS > m->heap_top){
+                    m->heap_top = page + n * PAGE_WORDS;
+                }
+                return page;
             }
 
             // if we are here, we are in the last free list
-            // -> go to next block
-            prev = block;
-            block = list_next(block);
+            // -> go to next run
+            prev = run;
+            run = list_next(m, run);
         }
     }
-    // no block found
+    // no run found
     return NULL;
 }
 
-uvalue_t *memory_allocate(tag_t tag, uvalue_t size){
-    assert(heap_start != NULL);
+static uvalue_t *block_allocate(memory_t *m, tag_t tag, uvalue_t size){
+    uvalue_t header = header_pack(tag, size);
+    uvalue_t *block;
+
+    if (is_small(size)){
+        size_class_t *class = class_get(m, header);
+        if (class->free == m->memory_start){
+            // no free block of this class -> give it a new page
+            uvalue_t *page = run_allocate(m, 1);
+            if (page == NULL)
+                return NULL;
+            page[0] = header;
+            class_link_free(m, class, page);
+        }
+        block = class->free;
+        class->free = list_next(m, block);
+    }else{
+        uvalue_t *page = run_allocate(m, run_pages(size));
+        if (page == NULL)
+            return NULL;
+        page[0] = header;
+        block = page + HEADER_SIZE;
+    }
 
-    uvalue_t *block = block_allocate(tag, size);
+    // initilize the new block
+    bm_set(m, m->bitmap_start, block);
+    block[0] = 0;
+    return block;
+}
+
+uvalue_t *memory_allocate(vm_context_t *vm, tag_t tag, uvalue_t size){
+    memory_t *m = vm->memory;
+    assert(m->heap_start != NULL);
+
+    if (dump_requested && dump_file_name != NULL){
+        dump_requested = 0;
+        heap_dump(vm, dump_reason_SIGNAL);
+    }
+
+    uvalue_t *block = block_allocate(m, tag, size);
     if (block == NULL){
         // Ouch! Cleanup garbage!
-        mark();
-        sweep();
-        block = block_allocate(tag, size);
+        double gc_start = timer_now();
+        perf_phase_t phase = perf_counters_enter(perf_phase_MARK);
+        mark(vm);
+        perf_counters_enter(perf_phase_SWEEP);
+        sweep(m);
+        perf_counters_enter(phase);
+        m->gc_seconds += timer_now() - gc_start;
+        if (dump_every_n_gcs > 0 && dump_file_name != NULL
+            && m->gc_count % dump_every_n_gcs == 0){
+            heap_dump(vm, dump_reason_PERIODIC);
+        }
+        block = block_allocate(m, tag, size);
 
         if (block == NULL){
+            if (dump_file_name != NULL)
+                heap_dump(vm, dump_reason_OOM);
             fail("cannot allocate %u bytes of memory", size);
         }
     }
 
+    #ifdef ALLOC_PROFILE
+    m->site_map[block - m->heap_start] = engine_get_alloc_site(vm);
+    alloc_profile_allocated(m->profile, m->site_map[block - m->heap_start],
+                            block_words(size));
+    #endif
+
     return block;
 }
 
@@ -299,54 +843,193 @@ uvalue_t *memory_allocate(tag_t tag, uvalue_t size){
  * Memory initialization and teardown
  *************************************/
 char *memory_get_identity(){
-    return "Mark and Sweep GC";
+    return "Mark and Sweep GC, BiBoP";
 }
 
-void memory_setup(size_t total_byte_size){
-    memory_start = calloc(total_byte_size, 1);
-    if (memory_start == NULL)
+void memory_setup(vm_context_t *vm, size_t total_byte_size){
+    memory_t *m = calloc(1, sizeof(memory_t));
+    if (m == NULL)
+        fail("cannot allocate memory state");
+    vm->memory = m;
+
+    // mapped rather than allocated, for the pages to be aligned
+    m->memory_start = mmap(NULL, total_byte_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m->memory_start == MAP_FAILED)
         fail("cannot allocate %zd bytes of memory", total_byte_size);
-    memory_end = memory_start + (total_byte_size / sizeof(value_t));
+    m->memory_end = m->memory_start + (total_byte_size / sizeof(value_t));
 }
 
-void memory_cleanup(){
-    assert(memory_start != NULL);
-    free(memory_start);
-
-    memory_start = memory_end = NULL;
-    bitmap_start = heap_start = NULL;
-    for (int i = 0; i < FL_SIZE; i++){
-        FL[i] = NULL;
-    }
+void memory_cleanup(vm_context_t *vm){
+    memory_t *m = vm->memory;
+    assert(m != NULL);
 
 #ifdef GC_STATS
-    printf("\nGC COUNT = %d\n", gc_count);
+    // on stderr, not to mix with the program output or the benchmark JSON
+    fprintf(stderr, "\nGC COUNT = %d\n", m->gc_count);
+    fprintf(stderr, "LIVE BYTES = %zu\n", (size_t)m->live_words * sizeof(uvalue_t));
+    if (dedup_strings)
+        fprintf(stderr, "DEDUPLICATED STRINGS = %u\n", m->strings_deduplicated);
 #endif
+
+#ifdef ALLOC_PROFILE
+    if (m->site_map != NULL){
+        alloc_profile_report(m->profile, stderr, PROFILE_TOP_SITES);
+        alloc_profile_cleanup(m->profile);
+        free(m->site_map);
+    }
+#endif
+
+    // the memory area is either mapped by memory_setup or from a snapshot
+    munmap(m->memory_start,
+           (size_t)(m->memory_end - m->memory_start) * sizeof(uvalue_t));
+    free(m->classes);
+    free(m->strings);
+    free(m);
+    vm->memory = NULL;
+}
+
+void *memory_get_start(vm_context_t *vm){
+    return vm->memory->memory_start;
 }
 
-void *memory_get_start(){
-    return memory_start;
+void *memory_get_end(vm_context_t *vm){
+    return vm->memory->memory_end;
 }
 
-void *memory_get_end(){
-    return memory_end;
+// Make the (zeroed) heap a single run of free pages
+static void heap_init(memory_t *m){
+    list_init(m);
+    classes_clear(m);
+    if (m->heap_end > m->heap_start){
+        run_free(m, m->heap_start, m->heap_end);
+    }
+    m->heap_top = m->heap_start;
 }
 
-void memory_set_heap_start(void *p_addr){
+void memory_set_heap_start(vm_context_t *vm, void *p_addr){
+    memory_t *m = vm->memory;
     assert(p_addr != NULL);
-    assert(bitmap_start == NULL);
+    assert(m->bitmap_start == NULL);
+
+    // every page takes PAGE_WORDS words and as many bits of both bitmaps,
+    // aligning the first one takes less than a page
+    uvalue_t total = (uvalue_t)(m->memory_end - (uvalue_t *)p_addr);
+    uvalue_t bm_page_words = PAGE_WORDS / VALUE_BITS;
+    uvalue_t pages = total > PAGE_WORDS
+        ? (total - PAGE_WORDS) / (PAGE_WORDS + 2 * bm_page_words) : 0;
+
+    m->bitmap_start = p_addr;
+    m->mark_bitmap_start = m->bitmap_start + pages * bm_page_words;
+    uintptr_t bitmaps_end = (uintptr_t)(m->mark_bitmap_start + pages * bm_page_words);
+    m->heap_start = (uvalue_t *)((bitmaps_end + PAGE_BYTES - 1) & ~(uintptr_t)(PAGE_BYTES - 1));
+    m->heap_end = m->heap_start + pages * PAGE_WORDS;
+    classes_setup(m, CLASSES_MIN_CAPACITY);
+    heap_init(m);
+
+#ifdef ALLOC_PROFILE
+    m->profile = alloc_profile_setup(addr_p_to_v(m, p_addr));
+    m->site_map = calloc(pages * PAGE_WORDS, sizeof(uvalue_t));
+    if (m->site_map == NULL)
+        fail("cannot allocate allocation site table");
+#endif
+}
+
+/*************************************
+ * Snapshots
+ *************************************/
+
+// allocator state in snapshots, with virtual addresses; the free lists
+// are rebuilt from the pages
+typedef struct {
+    uint64_t memory_size;
+    uvalue_t heap_start;
+    uvalue_t heap_end;
+    uvalue_t bitmap_start;
+    uvalue_t mark_bitmap_start;
+    uvalue_t heap_top;
+} saved_memory_t;
+
+void memory_save(vm_context_t *vm, FILE *file){
+    memory_t *m = vm->memory;
+    saved_memory_t saved = {
+        .memory_size = (uint64_t)(m->memory_end - m->memory_start) * sizeof(uvalue_t),
+        .heap_start = addr_p_to_v(m, m->heap_start),
+        .heap_end = addr_p_to_v(m, m->heap_end),
+        .bitmap_start = addr_p_to_v(m, m->bitmap_start),
+        .mark_bitmap_start = addr_p_to_v(m, m->mark_bitmap_start),
+        .heap_top = addr_p_to_v(m, m->heap_top)
+    };
+    if (fwrite(&saved, sizeof(saved), 1, file) != 1)
+        fail("cannot write snapshot memory state");
+    snapshot_write_area(file, m->memory_start, (size_t)saved.memory_size);
+}
+
+void memory_restore(vm_context_t *vm, FILE *file){
+    saved_memory_t saved;
+    if (fread(&saved, sizeof(saved), 1, file) != 1)
+        fail("cannot read snapshot memory state");
+
+    memory_t *m = calloc(1, sizeof(memory_t));
+    if (m == NULL)
+        fail("cannot allocate memory state");
+    vm->memory = m;
+
+    // the area is mapped at a page boundary, like the one it was saved
+    // from, so the pages stay aligned
+    m->memory_start = snapshot_map_area(file, (size_t)saved.memory_size);
+    m->memory_end = m->memory_start + (saved.memory_size / sizeof(value_t));
+    m->heap_start = addr_v_to_p(m, saved.heap_start);
+    m->heap_end = addr_v_to_p(m, saved.heap_end);
+    m->bitmap_start = addr_v_to_p(m, saved.bitmap_start);
+    m->mark_bitmap_start = addr_v_to_p(m, saved.mark_bitmap_start);
+    m->heap_top = addr_v_to_p(m, saved.heap_top);
+    classes_setup(m, CLASSES_MIN_CAPACITY);
+    heap_relink(m);
+
+#ifdef ALLOC_PROFILE
+    // the sites of the blocks allocated before the snapshot are unknown,
+    // they are attributed to the first instruction
+    uvalue_t heap_size = (uvalue_t)(m->heap_end - m->heap_start);
+    m->profile = alloc_profile_setup(saved.bitmap_start);
+    m->site_map = calloc(heap_size, sizeof(uvalue_t));
+    if (m->site_map == NULL)
+        fail("cannot allocate allocation site table");
+#endif
+}
 
-    uvalue_t total = (uvalue_t)((char *)memory_end - (char *)p_addr) / sizeof(uvalue_t);
-    uvalue_t bm_size = (total + VALUE_BITS - 1) / (VALUE_BITS + 1);
-    uvalue_t heap_size = total - bm_size;
+void memory_reset(vm_context_t *vm){
+    memory_t *m = vm->memory;
+    assert(m->heap_start != NULL);
 
-    bitmap_start = p_addr;
-    heap_start = bitmap_start + bm_size;
+    // pages were only allocated below heap_top, the words written past it
+    // are the header and the free list link of the remaining free run
+    uvalue_t *used_end = m->heap_top + HEADER_SIZE + 1;
+    if (used_end > m->heap_end){
+        used_end = m->heap_end;
+    }
+    uvalue_t used = (uvalue_t)(used_end - m->heap_start);
+    memset(m->heap_start, 0, used * sizeof(uvalue_t));
+    uvalue_t bm_used = used / VALUE_BITS + 1;
+    uvalue_t bm_size = (uvalue_t)(m->mark_bitmap_start - m->bitmap_start);
+    if (bm_used > bm_size){
+        bm_used = bm_size;
+    }
+    memset(m->bitmap_start, 0, bm_used * sizeof(uvalue_t));
+    memset(m->mark_bitmap_start, 0, bm_used * sizeof(uvalue_t));
+    // the strings of a collection interrupted by fail are no longer blocks
+    strings_end(m);
+#ifdef ALLOC_PROFILE
+    // the next program must not inherit the sites and counts of this one
+    memset(m->site_map, 0, used * sizeof(uvalue_t));
+    alloc_profile_reset(m->profile);
+#endif
 
-    list_init();
-    uvalue_t *free = heap_start + HEADER_SIZE;
-    free[-HEADER_SIZE] = header_pack(tag_None, (uvalue_t)(heap_size - HEADER_SIZE));
-    list_prepend(FL_SIZE - 1, free);
+    heap_init(m);
+    m->gc_count = 0;
+    m->gc_seconds = 0.0;
+    m->live_words = 0;
+    m->strings_deduplicated = 0;
 }
 
 uvalue_t memory_get_block_size(uvalue_t *block){
@@ -2,13 +2,20 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <assert.h>
+#include <string.h>
+#include <stdbool.h>
 
 #include "memory.h"
+#include "snapshot.h"
 #include "fail.h"
 
-static uvalue_t* memory_start = NULL;
-static uvalue_t* memory_end = NULL;
-static uvalue_t* free_boundary = NULL;
+struct memory {
+  uvalue_t* memory_start;
+  uvalue_t* memory_end;
+  uvalue_t* heap_start;
+  uvalue_t* free_boundary;
+  bool mapped;                  /* memory area mapped from a snapshot */
+};
 
 #define HEADER_SIZE 1
 
@@ -30,45 +37,125 @@ char* memory_get_identity() {
   return "no GC (memory is never freed)";
 }
 
-void memory_setup(size_t total_byte_size) {
-  memory_start = calloc(total_byte_size, 1);
-  if (memory_start == NULL)
+void memory_setup(vm_context_t* vm, size_t total_byte_size) {
+  memory_t* m = calloc(1, sizeof(memory_t));
+  if (m == NULL)
+    fail("cannot allocate memory state");
+  vm->memory = m;
+
+  m->memory_start = calloc(total_byte_size, 1);
+  if (m->memory_start == NULL)
     fail("cannot allocate %zd bytes of memory", total_byte_size);
-  memory_end = memory_start + (total_byte_size / sizeof(value_t));
+  m->memory_end = m->memory_start + (total_byte_size / sizeof(value_t));
+}
+
+void memory_cleanup(vm_context_t* vm) {
+  memory_t* m = vm->memory;
+  assert(m != NULL);
+  if (m->mapped)
+    snapshot_unmap_area(m->memory_start,
+                        (size_t)(m->memory_end - m->memory_start) * sizeof(uvalue_t));
+  else
+    free(m->memory_start);
+  free(m);
+  vm->memory = NULL;
+}
+
+void* memory_get_start(vm_context_t* vm) {
+  return vm->memory->memory_start;
+}
+
+void* memory_get_end(vm_context_t* vm) {
+  return vm->memory->memory_end;
 }
 
-void memory_cleanup() {
-  assert(memory_start != NULL);
-  free(memory_start);
-  memory_start = memory_end = free_boundary = NULL;
+void memory_set_heap_start(vm_context_t* vm, void* heap_start) {
+  assert(vm->memory->free_boundary == NULL);
+  vm->memory->heap_start = vm->memory->free_boundary = heap_start;
 }
 
-void* memory_get_start() {
-  return memory_start;
+// Snapshots
+
+/* Allocator state in snapshots, with virtual addresses */
+typedef struct {
+  uint64_t memory_size;
+  uvalue_t heap_start;
+  uvalue_t free_boundary;
+} saved_memory_t;
+
+void memory_save(vm_context_t* vm, FILE* file) {
+  memory_t* m = vm->memory;
+  char* start = (char*)m->memory_start;
+  saved_memory_t saved = {
+    (uint64_t)((char*)m->memory_end - start),
+    (uvalue_t)((char*)m->heap_start - start),
+    (uvalue_t)((char*)m->free_boundary - start)
+  };
+  if (fwrite(&saved, sizeof(saved), 1, file) != 1)
+    fail("cannot write snapshot memory state");
+  snapshot_write_area(file, m->memory_start, (size_t)saved.memory_size);
 }
 
-void* memory_get_end() {
-  return memory_end;
+void memory_restore(vm_context_t* vm, FILE* file) {
+  saved_memory_t saved;
+  if (fread(&saved, sizeof(saved), 1, file) != 1)
+    fail("cannot read snapshot memory state");
+
+  memory_t* m = calloc(1, sizeof(memory_t));
+  if (m == NULL)
+    fail("cannot allocate memory state");
+  vm->memory = m;
+
+  m->memory_start = snapshot_map_area(file, (size_t)saved.memory_size);
+  m->memory_end = m->memory_start + (saved.memory_size / sizeof(value_t));
+  m->mapped = true;
+  m->heap_start = (uvalue_t*)((char*)m->memory_start + saved.heap_start);
+  m->free_boundary = (uvalue_t*)((char*)m->memory_start + saved.free_boundary);
 }
 
-void memory_set_heap_start(void* heap_start) {
-  assert(free_boundary == NULL);
-  free_boundary = heap_start;
+void memory_reset(vm_context_t* vm) {
+  memory_t* m = vm->memory;
+  assert(m->heap_start != NULL);
+  memset(m->heap_start, 0,
+         (size_t)(m->free_boundary - m->heap_start) * sizeof(uvalue_t));
+  m->free_boundary = m->heap_start;
 }
 
-uvalue_t* memory_allocate(tag_t tag, uvalue_t size) {
-  assert(free_boundary != NULL);
+uvalue_t* memory_allocate(vm_context_t* vm, tag_t tag, uvalue_t size) {
+  memory_t* m = vm->memory;
+  assert(m->free_boundary != NULL);
 
   const uvalue_t total_size = size + HEADER_SIZE;
-  if (free_boundary + total_size > memory_end)
+  if (m->free_boundary + total_size > m->memory_end)
     fail("no memory left (block of size %u requested)", size);
 
-  *free_boundary = header_pack(tag, size);
-  uvalue_t* res = free_boundary + HEADER_SIZE;
-  free_boundary += total_size;
+  *m->free_boundary = header_pack(tag, size);
+  uvalue_t* res = m->free_boundary + HEADER_SIZE;
+  m->free_boundary += total_size;
   return res;
 }
 
+void memory_get_stats(vm_context_t* vm, memory_stats_t* stats) {
+  memory_t* m = vm->memory;
+  stats->gc_count = 0;
+  stats->gc_seconds = 0.0;
+  stats->live_bytes = (size_t)(m->free_boundary - m->heap_start) * sizeof(uvalue_t);
+  stats->strings_deduplicated = 0;
+}
+
+void memory_set_dump(char* file_name, uvalue_t every_n_gcs) {
+  (void)file_name;
+  (void)every_n_gcs;
+}
+
+void memory_set_dedup_strings(bool dedup) {
+  (void)dedup;
+}
+
+void memory_request_dump() {
+  // nothing to do
+}
+
 uvalue_t memory_get_block_size(uvalue_t* block) {
   return header_unpack_size(block[-1]);
 }
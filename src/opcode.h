@@ -8,9 +8,10 @@ typedef enum {
   opcode_TCAL, opcode_CALL, opcode_RET, opcode_HALT,
   opcode_LDLO, opcode_LDHI, opcode_MOVE,
   opcode_RALO, opcode_BALO, opcode_BSIZ, opcode_BTAG, opcode_BGET, opcode_BSET,
-  opcode_BREA, opcode_BWRI,
+  opcode_BREA, opcode_BWRI, opcode_BRDB, opcode_BWRB,
+  opcode_BCPY, opcode_BFIL, opcode_BCMP,
 } opcode_t;
 
-#define OPCODE_COUNT (opcode_BWRI+1)
+#define OPCODE_COUNT (opcode_BCMP+1)
 
 #endif // OPCODE_H
@@ -0,0 +1,688 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "optimizer.h"
+#include "opcode.h"
+#include "fail.h"
+
+#define REG_COUNT 256
+
+/* Longest chain of jumps followed when threading a jump */
+#define MAX_THREAD_STEPS 16
+
+/* A set of registers */
+typedef struct {
+  uint64_t words[REG_COUNT / 64];
+} reg_set_t;
+
+typedef struct {
+  size_t start;
+  size_t end;
+  bool optimizable;
+  reg_set_t live_in;            /* registers read before being written */
+} block_t;
+
+typedef struct {
+  instr_t* code;
+  size_t size;                  /* in instructions */
+  bool* leader;                 /* may be reached other than by fall-through */
+  bool* removed;
+  size_t* block_of;             /* index of the block of each instruction */
+  block_t* blocks;
+  size_t block_count;
+  optimizer_stats_t* stats;
+  /* instructions of the original code that executing each instruction
+     saves, and taking each conditional jump (see vm_context_t) */
+  uint32_t* saved_at;
+  uint32_t* saved_if_taken;
+} program_t;
+
+// Instruction decoding and encoding
+
+static unsigned int extract_u(instr_t instr, int start, int len) {
+  return (instr >> start) & ((1u << len) - 1);
+}
+
+static int extract_s(instr_t instr, int start, int len) {
+  int bits = (int)extract_u(instr, start, len);
+  int m = 1 << (len - 1);
+  return (bits ^ m) - m;
+}
+
+static bool is_valid(instr_t instr) {
+  return extract_u(instr, 26, 6) < OPCODE_COUNT;
+}
+
+static opcode_t instr_opcode(instr_t instr) {
+  return (opcode_t)extract_u(instr, 26, 6);
+}
+
+static unsigned int instr_ra(instr_t instr) {
+  return extract_u(instr, 18, 8);
+}
+
+static unsigned int instr_rb(instr_t instr) {
+  return extract_u(instr, 10, 8);
+}
+
+static unsigned int instr_rc(instr_t instr) {
+  return extract_u(instr, 2, 8);
+}
+
+static bool is_conditional_jump(opcode_t op) {
+  return op == opcode_JLT || op == opcode_JLE
+    || op == opcode_JEQ || op == opcode_JNE;
+}
+
+static bool is_two_words(opcode_t op) {
+  return op == opcode_BCPY || op == opcode_BFIL;
+}
+
+static bool ends_block(opcode_t op) {
+  return is_conditional_jump(op) || op == opcode_JI || op == opcode_TCAL
+    || op == opcode_CALL || op == opcode_RET || op == opcode_HALT;
+}
+
+static int jump_displacement(instr_t instr) {
+  return instr_opcode(instr) == opcode_JI
+    ? extract_s(instr, 0, 26)
+    : extract_s(instr, 0, 10);
+}
+
+static bool fits_signed(long value, int len) {
+  return value >= -(1L << (len - 1)) && value < (1L << (len - 1));
+}
+
+static instr_t with_displacement(instr_t instr, long d) {
+  instr_t mask = instr_opcode(instr) == opcode_JI ? 0x3FFFFFF : 0x3FF;
+  return (instr & ~mask) | ((instr_t)d & mask);
+}
+
+static instr_t encode_ji(long d) {
+  return ((instr_t)opcode_JI << 26) | ((instr_t)d & 0x3FFFFFF);
+}
+
+static instr_t encode_ldlo(unsigned int ra, uvalue_t value) {
+  return ((instr_t)opcode_LDLO << 26) | (ra << 18) | (value & 0x3FFFF);
+}
+
+// Register sets
+
+static const reg_set_t all_registers = {
+  { UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX }
+};
+
+static bool reg_set_contains(const reg_set_t* set, int r) {
+  return (set->words[r / 64] & ((uint64_t)1 << (r % 64))) != 0;
+}
+
+static void reg_set_add(reg_set_t* set, int r) {
+  set->words[r / 64] |= (uint64_t)1 << (r % 64);
+}
+
+static void reg_set_remove(reg_set_t* set, int r) {
+  set->words[r / 64] &= ~((uint64_t)1 << (r % 64));
+}
+
+static void reg_set_union(reg_set_t* set, const reg_set_t* other) {
+  for (size_t w = 0; w < REG_COUNT / 64; ++w)
+    set->words[w] |= other->words[w];
+}
+
+static bool reg_set_equal(const reg_set_t* a, const reg_set_t* b) {
+  return memcmp(a->words, b->words, sizeof(a->words)) == 0;
+}
+
+// Register effects
+
+typedef struct {
+  int def;                      /* register written, -1 for none */
+  int uses[3];                  /* registers read, -1 for none */
+  bool barrier;                 /* may read or write any register */
+  bool removable;               /* has no effect besides writing def */
+} effect_t;
+
+static effect_t instr_effect(instr_t instr) {
+  effect_t effect = { -1, { -1, -1, -1 }, false, false };
+  int a = (int)instr_ra(instr);
+  int b = (int)instr_rb(instr);
+  int c = (int)instr_rc(instr);
+  switch (instr_opcode(instr)) {
+  case opcode_ADD: case opcode_SUB: case opcode_MUL:
+  case opcode_LSL: case opcode_LSR:
+  case opcode_AND: case opcode_OR: case opcode_XOR:
+    effect = (effect_t){ a, { b, c, -1 }, false, true };
+    break;
+  case opcode_DIV: case opcode_MOD:
+    /* may trap */
+    effect = (effect_t){ a, { b, c, -1 }, false, false };
+    break;
+  case opcode_LDLO:
+    effect = (effect_t){ a, { -1, -1, -1 }, false, true };
+    break;
+  case opcode_LDHI:
+    effect = (effect_t){ a, { a, -1, -1 }, false, true };
+    break;
+  case opcode_MOVE:
+    effect = (effect_t){ a, { b, -1, -1 }, false, true };
+    break;
+  case opcode_BALO: case opcode_BSIZ: case opcode_BTAG:
+    effect = (effect_t){ a, { b, -1, -1 }, false, false };
+    break;
+  case opcode_BGET: case opcode_BCMP: case opcode_BRDB:
+    effect = (effect_t){ a, { b, c, -1 }, false, false };
+    break;
+  case opcode_BSET: case opcode_BWRB:
+    effect = (effect_t){ -1, { a, b, c }, false, false };
+    break;
+  case opcode_BREA:
+    effect = (effect_t){ a, { -1, -1, -1 }, false, false };
+    break;
+  case opcode_BWRI:
+    effect = (effect_t){ -1, { a, -1, -1 }, false, false };
+    break;
+  case opcode_JLT: case opcode_JLE: case opcode_JEQ: case opcode_JNE:
+    effect = (effect_t){ -1, { a, b, -1 }, false, false };
+    break;
+  case opcode_JI:
+    break;
+  default:
+    /* calls, returns and RALO change the register banks */
+    effect.barrier = true;
+    break;
+  }
+  return effect;
+}
+
+// Comparisons
+
+/* The possible orderings of Ra and Rb, as a set */
+enum { order_LT = 1, order_EQ = 2, order_GT = 4 };
+
+static unsigned int jump_orders(opcode_t op) {
+  switch (op) {
+  case opcode_JLT: return order_LT;
+  case opcode_JLE: return order_LT | order_EQ;
+  case opcode_JEQ: return order_EQ;
+  case opcode_JNE: return order_LT | order_GT;
+  default: return 0;
+  }
+}
+
+static unsigned int swap_orders(unsigned int orders) {
+  return (orders & order_EQ)
+    | ((orders & order_LT) != 0 ? order_GT : 0)
+    | ((orders & order_GT) != 0 ? order_LT : 0);
+}
+
+static unsigned int compare(uvalue_t a, uvalue_t b) {
+  if ((value_t)a < (value_t)b)
+    return order_LT;
+  return a == b ? order_EQ : order_GT;
+}
+
+// Constant folding
+
+static bool fold_arithmetic(opcode_t op, uvalue_t b, uvalue_t c,
+                            uvalue_t* result) {
+  switch (op) {
+  case opcode_ADD: *result = b + c; return true;
+  case opcode_SUB: *result = b - c; return true;
+  case opcode_MUL: *result = b * c; return true;
+  case opcode_DIV:
+  case opcode_MOD:
+    if (c == 0 || ((value_t)b == INT32_MIN && (value_t)c == -1))
+      return false;
+    *result = op == opcode_DIV
+      ? (uvalue_t)((value_t)b / (value_t)c)
+      : (uvalue_t)((value_t)b % (value_t)c);
+    return true;
+  case opcode_LSL: *result = b << (c & 0x1F); return true;
+  case opcode_LSR: *result = b >> (c & 0x1F); return true;
+  case opcode_AND: *result = b & c; return true;
+  case opcode_OR: *result = b | c; return true;
+  case opcode_XOR: *result = b ^ c; return true;
+  default: return false;
+  }
+}
+
+/* Replace the instruction at i, which writes value to ra, by a constant
+   load if the value fits */
+static void fold_to_constant(program_t* p, size_t i, unsigned int ra,
+                             uvalue_t value) {
+  if (fits_signed((value_t)value, 18)) {
+    p->code[i] = encode_ldlo(ra, value);
+    p->stats->folded += 1;
+  }
+}
+
+/* Propagate the constants loaded in the block [start, end) */
+static void fold_block(program_t* p, size_t start, size_t end) {
+  bool known[REG_COUNT] = { false };
+  uvalue_t value[REG_COUNT];
+
+  for (size_t i = start; i < end; ++i) {
+    instr_t instr = p->code[i];
+    opcode_t op = instr_opcode(instr);
+    unsigned int a = instr_ra(instr);
+    unsigned int b = instr_rb(instr);
+    unsigned int c = instr_rc(instr);
+    switch (op) {
+    case opcode_LDLO:
+      known[a] = true;
+      value[a] = (uvalue_t)extract_s(instr, 0, 18);
+      break;
+
+    case opcode_LDHI:
+      if (known[a]) {
+        uvalue_t v = (extract_u(instr, 0, 16) << 16) | (value[a] & 0xFFFF);
+        if (v == value[a])
+          p->removed[i] = true;
+        value[a] = v;
+      }
+      break;
+
+    case opcode_MOVE:
+      if (a == b) {
+        p->removed[i] = true;
+      } else if (known[b]) {
+        fold_to_constant(p, i, a, value[b]);
+        known[a] = true;
+        value[a] = value[b];
+      } else {
+        known[a] = false;
+      }
+      break;
+
+    case opcode_ADD: case opcode_SUB: case opcode_MUL:
+    case opcode_DIV: case opcode_MOD:
+    case opcode_LSL: case opcode_LSR:
+    case opcode_AND: case opcode_OR: case opcode_XOR: {
+      uvalue_t result;
+      if (known[b] && known[c] && fold_arithmetic(op, value[b], value[c], &result)) {
+        fold_to_constant(p, i, a, result);
+        known[a] = true;
+        value[a] = result;
+      } else {
+        known[a] = false;
+      }
+    } break;
+
+    case opcode_JLT: case opcode_JLE: case opcode_JEQ: case opcode_JNE: {
+      unsigned int orders;
+      if (a == b)
+        orders = order_EQ;
+      else if (known[a] && known[b])
+        orders = compare(value[a], value[b]);
+      else
+        break;
+      if ((orders & jump_orders(op)) != 0)
+        p->code[i] = encode_ji(jump_displacement(instr));
+      else
+        p->removed[i] = true;
+      p->stats->folded += 1;
+    } break;
+
+    default: {
+      /* the other jumps end the block */
+      effect_t effect = instr_effect(instr);
+      if (effect.barrier)
+        memset(known, 0, sizeof(known));
+      else if (effect.def >= 0)
+        known[effect.def] = false;
+    } break;
+    }
+  }
+}
+
+// Liveness
+
+/* Update live, the registers live after the instruction, to the ones
+   live before it */
+static void step_liveness(reg_set_t* live, const effect_t* effect) {
+  if (effect->barrier) {
+    *live = all_registers;
+    return;
+  }
+  if (effect->def >= 0)
+    reg_set_remove(live, effect->def);
+  for (int u = 0; u < 3; ++u) {
+    if (effect->uses[u] >= 0)
+      reg_set_add(live, effect->uses[u]);
+  }
+}
+
+static reg_set_t live_at(const program_t* p, long index) {
+  if (index < 0 || (size_t)index >= p->size)
+    return all_registers;
+  return p->blocks[p->block_of[index]].live_in;
+}
+
+static reg_set_t live_out(const program_t* p, const block_t* block) {
+  instr_t last = p->code[block->end - 1];
+  opcode_t op = instr_opcode(last);
+  if (op == opcode_JI)
+    return live_at(p, (long)block->end - 1 + jump_displacement(last));
+
+  reg_set_t live = live_at(p, (long)block->end);
+  if (is_conditional_jump(op)) {
+    reg_set_t taken = live_at(p, (long)block->end - 1 + jump_displacement(last));
+    reg_set_union(&live, &taken);
+  }
+  return live;
+}
+
+/* Compute the registers live at the start of every block, the blocks
+   that cannot be optimized reading all of them */
+static void compute_liveness(program_t* p) {
+  for (size_t b = 0; b < p->block_count; ++b) {
+    block_t* block = &p->blocks[b];
+    if (!block->optimizable)
+      block->live_in = all_registers;
+  }
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t b = p->block_count; b-- > 0;) {
+      block_t* block = &p->blocks[b];
+      if (!block->optimizable)
+        continue;
+      reg_set_t live = live_out(p, block);
+      for (size_t i = block->end; i-- > block->start;) {
+        if (!p->removed[i]) {
+          effect_t effect = instr_effect(p->code[i]);
+          step_liveness(&live, &effect);
+        }
+      }
+      if (!reg_set_equal(&live, &block->live_in)) {
+        block->live_in = live;
+        changed = true;
+      }
+    }
+  }
+}
+
+// Dead instruction removal
+
+/* Remove the removable instructions of the block whose result is not
+   live */
+static void remove_dead(program_t* p, const block_t* block) {
+  reg_set_t live = live_out(p, block);
+  for (size_t i = block->end; i-- > block->start;) {
+    if (p->removed[i])
+      continue;
+    effect_t effect = instr_effect(p->code[i]);
+    if (effect.removable && !reg_set_contains(&live, effect.def)) {
+      p->removed[i] = true;
+      continue;
+    }
+    step_liveness(&live, &effect);
+  }
+}
+
+/* Pack the instructions of the block [start, end) towards its start if
+   it ends with a jump, a tail call, a return or HALT, so that the removed
+   ones are never executed; otherwise, pack them towards its end, its
+   last instruction keeping its address, and jump over the removed ones
+   from the start of the block */
+static void compact_block(program_t* p, size_t start, size_t end) {
+  opcode_t last_op = instr_opcode(p->code[end - 1]);
+  bool leaves = !p->removed[end - 1]
+    && (last_op == opcode_JI || last_op == opcode_TCAL
+        || last_op == opcode_RET || last_op == opcode_HALT);
+
+  if (leaves) {
+    size_t dest = start;
+    for (size_t i = start; i < end; ++i) {
+      if (p->removed[i])
+        continue;
+      instr_t instr = p->code[i];
+      if (instr_opcode(instr) == opcode_JI)
+        instr = encode_ji(jump_displacement(instr) + (long)(i - dest));
+      p->code[dest++] = instr;
+    }
+    if (dest == end)
+      return;
+
+    /* never executed, but keep valid code */
+    for (size_t i = dest; i < end; ++i)
+      p->code[i] = encode_ji((long)(end - i));
+    p->stats->removed += (unsigned int)(end - dest);
+    /* the block is always entered at its start */
+    p->saved_at[start] += (uint32_t)(end - dest);
+    return;
+  }
+
+  size_t dest = end;
+  for (size_t i = end; i-- > start;) {
+    if (!p->removed[i])
+      p->code[--dest] = p->code[i];
+  }
+  if (dest == start)
+    return;
+
+  for (size_t i = start; i < dest; ++i)
+    p->code[i] = encode_ji((long)(dest - i));
+  p->stats->removed += (unsigned int)(dest - start);
+  p->stats->skips += 1;
+  /* the JI at the start, the only one executed, stands for the removed
+     instructions */
+  p->saved_at[start] += (uint32_t)(dest - start - 1);
+}
+
+// Basic blocks
+
+static void mark_code_address(program_t* p, uvalue_t address) {
+  if (address % sizeof(instr_t) == 0 && address / sizeof(instr_t) < p->size)
+    p->leader[address / sizeof(instr_t)] = true;
+}
+
+static void find_leaders(program_t* p) {
+  p->leader[0] = true;
+  for (size_t i = 0; i < p->size; ++i) {
+    instr_t instr = p->code[i];
+    if (!is_valid(instr))
+      continue;
+    opcode_t op = instr_opcode(instr);
+
+    if (op == opcode_JI || is_conditional_jump(op)) {
+      long target = (long)i + jump_displacement(instr);
+      if (target >= 0 && (size_t)target < p->size)
+        p->leader[target] = true;
+    }
+    if (ends_block(op) && i + 1 < p->size)
+      p->leader[i + 1] = true;
+
+    /* code addresses, as used by CALL and TCAL */
+    if (op == opcode_LDLO) {
+      uvalue_t value = (uvalue_t)extract_s(instr, 0, 18);
+      mark_code_address(p, value);
+      if (i + 1 < p->size && instr_opcode(p->code[i + 1]) == opcode_LDHI
+          && instr_ra(p->code[i + 1]) == instr_ra(instr))
+        mark_code_address(p, (extract_u(p->code[i + 1], 0, 16) << 16)
+                          | (value & 0xFFFF));
+    }
+  }
+
+  /* the extension word of a two-word instruction is not an instruction */
+  for (size_t i = 0; i + 1 < p->size; ++i) {
+    if (is_valid(p->code[i]) && is_two_words(instr_opcode(p->code[i]))) {
+      p->leader[i + 1] = false;
+      i += 1;
+    }
+  }
+}
+
+static bool is_optimizable(const program_t* p, size_t start, size_t end) {
+  for (size_t i = start; i < end; ++i) {
+    if (!is_valid(p->code[i]) || is_two_words(instr_opcode(p->code[i])))
+      return false;
+  }
+  return true;
+}
+
+// Jump threading
+
+/* Number of instructions that executing the instruction at i stands for,
+   itself included, when it is a jump taken if taken is true */
+static uint32_t executed_at(const program_t* p, long i, bool taken) {
+  return 1 + p->saved_at[i] + (taken ? p->saved_if_taken[i] : 0);
+}
+
+/* Return the index of the instruction that the jump at i eventually
+   reaches, following JIs and the conditional jumps on the same registers
+   whose outcome is known; add the number of instructions executed on
+   the way to *skipped */
+static long thread_target(const program_t* p, size_t i, uint32_t* skipped) {
+  instr_t instr = p->code[i];
+  unsigned int a = instr_ra(instr);
+  unsigned int b = instr_rb(instr);
+  unsigned int known_orders = jump_orders(instr_opcode(instr));
+  long target = (long)i + jump_displacement(instr);
+
+  for (int step = 0; step < MAX_THREAD_STEPS; ++step) {
+    if (target < 0 || (size_t)target >= p->size || !is_valid(p->code[target]))
+      break;
+    instr_t next = p->code[target];
+    opcode_t next_op = instr_opcode(next);
+    if (next_op == opcode_JI) {
+      *skipped += executed_at(p, target, true);
+      target += jump_displacement(next);
+      continue;
+    }
+    if (known_orders == 0 || !is_conditional_jump(next_op))
+      break;
+
+    unsigned int orders = jump_orders(next_op);
+    if (instr_ra(next) == b && instr_rb(next) == a)
+      orders = swap_orders(orders);
+    else if (instr_ra(next) != a || instr_rb(next) != b)
+      break;
+    if ((known_orders & ~orders) == 0) {
+      *skipped += executed_at(p, target, true);
+      target += jump_displacement(next);
+    } else if ((known_orders & orders) == 0) {
+      *skipped += executed_at(p, target, false);
+      target += 1;
+    } else {
+      break;
+    }
+  }
+  return target;
+}
+
+static void thread_jumps(program_t* p) {
+  for (size_t i = 0; i < p->size; ++i) {
+    instr_t instr = p->code[i];
+    if (!is_valid(instr))
+      continue;
+    opcode_t op = instr_opcode(instr);
+    if (is_two_words(op)) {
+      i += 1;
+      continue;
+    }
+    if (op != opcode_JI && !is_conditional_jump(op))
+      continue;
+
+    long target = (long)i + jump_displacement(instr);
+    uint32_t skipped = 0;
+    long threaded = thread_target(p, i, &skipped);
+    if (threaded < 0 || (size_t)threaded >= p->size)
+      continue;
+
+    opcode_t threaded_op = instr_opcode(p->code[threaded]);
+    if (op == opcode_JI && is_valid(p->code[threaded])
+        && (threaded_op == opcode_RET || threaded_op == opcode_HALT)) {
+      p->code[i] = p->code[threaded];
+      p->saved_at[i] += skipped + executed_at(p, threaded, false);
+      p->stats->threaded += 1;
+    } else if (threaded != target
+               && fits_signed(threaded - (long)i, op == opcode_JI ? 26 : 10)) {
+      p->code[i] = with_displacement(instr, threaded - (long)i);
+      if (op == opcode_JI)
+        p->saved_at[i] += skipped;
+      else
+        p->saved_if_taken[i] += skipped;
+      p->stats->threaded += 1;
+    }
+  }
+}
+
+// Optimizer
+
+void optimizer_run(vm_context_t* vm, optimizer_stats_t* stats) {
+  memset(stats, 0, sizeof(*stats));
+  program_t p = {
+    vm->memory_start, (size_t)(vm->code_end - (instr_t*)vm->memory_start),
+    NULL, NULL, NULL, NULL, 0, stats, NULL, NULL
+  };
+  stats->instructions = (unsigned int)p.size;
+  if (p.size == 0)
+    return;
+
+  p.leader = calloc(p.size, sizeof(bool));
+  p.removed = calloc(p.size, sizeof(bool));
+  p.block_of = calloc(p.size, sizeof(size_t));
+  p.saved_at = calloc(p.size, sizeof(uint32_t));
+  p.saved_if_taken = calloc(p.size, sizeof(uint32_t));
+  if (p.leader == NULL || p.removed == NULL || p.block_of == NULL
+      || p.saved_at == NULL || p.saved_if_taken == NULL)
+    fail("cannot allocate optimizer tables");
+
+  find_leaders(&p);
+  for (size_t i = 0; i < p.size; ++i)
+    p.block_count += p.leader[i] ? 1 : 0;
+  p.blocks = calloc(p.block_count, sizeof(block_t));
+  if (p.blocks == NULL)
+    fail("cannot allocate optimizer tables");
+  for (size_t i = 0, b = 0; i < p.size; ++i) {
+    if (p.leader[i]) {
+      if (b > 0)
+        p.blocks[b - 1].end = i;
+      p.blocks[b++].start = i;
+    }
+    p.block_of[i] = b - 1;
+  }
+  p.blocks[p.block_count - 1].end = p.size;
+  stats->blocks = (unsigned int)p.block_count;
+
+  for (size_t b = 0; b < p.block_count; ++b) {
+    block_t* block = &p.blocks[b];
+    block->optimizable = is_optimizable(&p, block->start, block->end);
+    if (block->optimizable)
+      fold_block(&p, block->start, block->end);
+  }
+  compute_liveness(&p);
+  for (size_t b = 0; b < p.block_count; ++b) {
+    if (p.blocks[b].optimizable)
+      remove_dead(&p, &p.blocks[b]);
+  }
+  for (size_t b = 0; b < p.block_count; ++b) {
+    if (p.blocks[b].optimizable)
+      compact_block(&p, p.blocks[b].start, p.blocks[b].end);
+  }
+  thread_jumps(&p);
+
+#ifdef GC_STATS
+  /* count the instructions saved as the program runs */
+  vm->saved_at = p.saved_at;
+  vm->saved_if_taken = p.saved_if_taken;
+#else
+  free(p.saved_if_taken);
+  free(p.saved_at);
+#endif
+  free(p.blocks);
+  free(p.block_of);
+  free(p.removed);
+  free(p.leader);
+}
+
+void optimizer_report(const optimizer_stats_t* stats, FILE* out) {
+  fprintf(out, "optimizer: %u instructions in %u blocks, %u removed, "
+          "%u folded, %u jumps threaded, %u skips inserted\n",
+          stats->instructions, stats->blocks, stats->removed,
+          stats->folded, stats->threaded, stats->skips);
+}
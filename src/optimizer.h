@@ -0,0 +1,45 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include <stdio.h>
+#include "vm_context.h"
+
+typedef struct {
+  unsigned int instructions;    /* words of code examined */
+  unsigned int blocks;          /* basic blocks */
+  unsigned int removed;         /* dead or redundant instructions removed */
+  unsigned int folded;          /* instructions replaced by a constant load
+                                   or an unconditional jump */
+  unsigned int threaded;        /* jumps retargeted past jumps */
+  unsigned int skips;           /* jumps inserted over removed instructions */
+} optimizer_stats_t;
+
+/* Rewrite the code loaded by program_load in place, before it runs:
+ *
+ *   - constant folding of LDLO/LDHI constants through arithmetic, moves
+ *     and conditional jumps within a basic block,
+ *   - removal of self moves, redundant LDHIs and dead instructions:
+ *     arithmetic (but DIV and MOD, which may trap), LDLO, LDHI and MOVE
+ *     whose result is not live, liveness being computed over the whole
+ *     control flow graph and instructions that change the register
+ *     banks (calls, returns, RALO...) reading all registers,
+ *   - jump threading through JI chains and conditional jumps whose
+ *     outcome follows from the jump that reaches them, and JI to RET or
+ *     HALT replaced by a copy of that instruction.
+ *
+ * Addresses that may be reached other than by fall-through (jump
+ * targets, return addresses and the code addresses loaded by LDLO, which
+ * CALL and TCAL use as targets) start basic blocks and never move. The
+ * remaining instructions of a block ending with JI, TCAL, RET or HALT are
+ * packed towards its start, the JIs left after them never executed;
+ * those of the other blocks are packed towards their end, behind JIs over
+ * the removed ones, the one at the block start being skipped by the
+ * jumps into the block once they are threaded. Blocks with BCPY or BFIL
+ * or with invalid instructions are left untouched, all registers being
+ * live at their start. */
+void optimizer_run(vm_context_t* vm, optimizer_stats_t* stats);
+
+/* Print the statistics of an optimizer run */
+void optimizer_report(const optimizer_stats_t* stats, FILE* out);
+
+#endif // OPTIMIZER_H
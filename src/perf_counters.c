@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+
+#include "perf_counters.h"
+
+typedef struct {
+  const char* name;
+  uint32_t type;
+  uint64_t config;
+} event_t;
+
+#define CACHE_MISS(cache) \
+  ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8)    \
+   | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const event_t events[] = {
+  { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+  { "L1d-misses", PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_L1D) },
+  { "LLC-misses", PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_LL) },
+  { "dTLB-misses", PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB) },
+};
+
+#define EVENT_COUNT (sizeof(events) / sizeof(events[0]))
+
+enum { ev_CYCLES, ev_INSTRUCTIONS, ev_BRANCH_MISSES };
+
+static const char* phase_names[PERF_PHASE_COUNT] = {
+  "other", "interpreter", "mark", "sweep"
+};
+
+static int fds[EVENT_COUNT];
+static bool enabled = false;
+static perf_phase_t current_phase = perf_phase_NONE;
+static double last_value[EVENT_COUNT];
+static double totals[PERF_PHASE_COUNT][EVENT_COUNT];
+
+static int open_event(const event_t* event) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = event->type;
+  attr.config = event->config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format =
+    PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* Current value of a counter, scaled if it was multiplexed */
+static double read_event(int fd) {
+  uint64_t data[3];             /* value, time enabled, time running */
+  if (fd < 0 || read(fd, data, sizeof(data)) != sizeof(data))
+    return 0.0;
+  if (data[2] == 0)
+    return 0.0;
+  return (double)data[0] * ((double)data[1] / (double)data[2]);
+}
+
+bool perf_counters_setup(void) {
+  bool any_open = false;
+  for (size_t e = 0; e < EVENT_COUNT; ++e) {
+    fds[e] = open_event(&events[e]);
+    if (fds[e] >= 0) {
+      any_open = true;
+      ioctl(fds[e], PERF_EVENT_IOC_RESET, 0);
+      ioctl(fds[e], PERF_EVENT_IOC_ENABLE, 0);
+    }
+    last_value[e] = 0.0;
+  }
+  enabled = any_open;
+  return any_open;
+}
+
+void perf_counters_cleanup(void) {
+  if (!enabled)
+    return;
+  for (size_t e = 0; e < EVENT_COUNT; ++e) {
+    if (fds[e] >= 0)
+      close(fds[e]);
+    fds[e] = -1;
+  }
+  enabled = false;
+}
+
+perf_phase_t perf_counters_enter(perf_phase_t phase) {
+  perf_phase_t previous = current_phase;
+  if (!enabled || phase == previous)
+    return previous;
+
+  for (size_t e = 0; e < EVENT_COUNT; ++e) {
+    double value = read_event(fds[e]);
+    totals[previous][e] += value - last_value[e];
+    last_value[e] = value;
+  }
+  current_phase = phase;
+  return previous;
+}
+
+void perf_counters_report(FILE* out) {
+  if (!enabled)
+    return;
+  perf_counters_enter(perf_phase_NONE);
+
+  fprintf(out, "\nHardware counters:\n  %-12s", "phase");
+  for (size_t e = 0; e < EVENT_COUNT; ++e)
+    fprintf(out, " %15s", events[e].name);
+  fprintf(out, " %6s %12s\n", "IPC", "br-miss/kI");
+
+  for (int p = perf_phase_INTERPRETER; p < PERF_PHASE_COUNT; ++p) {
+    fprintf(out, "  %-12s", phase_names[p]);
+    for (size_t e = 0; e < EVENT_COUNT; ++e) {
+      if (fds[e] < 0)
+        fprintf(out, " %15s", "n/a");
+      else
+        fprintf(out, " %15.0f", totals[p][e]);
+    }
+    double cycles = totals[p][ev_CYCLES];
+    double instructions = totals[p][ev_INSTRUCTIONS];
+    fprintf(out, " %6.2f %12.2f\n",
+            cycles > 0 ? instructions / cycles : 0.0,
+            instructions > 0
+            ? 1000.0 * totals[p][ev_BRANCH_MISSES] / instructions : 0.0);
+  }
+}
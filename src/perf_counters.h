@@ -0,0 +1,32 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+/* Hardware performance counters (Linux perf_event_open), attributed to
+ * the phase of the VM that is running when they are read. */
+
+typedef enum {
+  perf_phase_NONE,
+  perf_phase_INTERPRETER,
+  perf_phase_MARK,
+  perf_phase_SWEEP
+} perf_phase_t;
+
+#define PERF_PHASE_COUNT (perf_phase_SWEEP+1)
+
+/* Open the counters, return false if none is available */
+bool perf_counters_setup(void);
+
+/* Close the counters */
+void perf_counters_cleanup(void);
+
+/* Attribute the events counted from now on to phase, return the
+ * previous phase */
+perf_phase_t perf_counters_enter(perf_phase_t phase);
+
+/* Print the per-phase breakdown of the counters */
+void perf_counters_report(FILE* out);
+
+#endif // PERF_COUNTERS_H
@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdalign.h>
+#include <assert.h>
+
+#include "program.h"
+#include "memory.h"
+#include "engine.h"
+#include "fail.h"
+
+// Memory/size alignment
+
+static size_t align_down(size_t value, size_t align) {
+  assert(align > 0 && (align & (align - 1)) == 0); /* check power of 2 */
+  return value & ~(align - 1);
+}
+
+static void* align_up(void* address, size_t align) {
+  assert(align > 0 && (align & (align - 1)) == 0); /* check power of 2 */
+  uintptr_t int_address = (uintptr_t)address;
+  uintptr_t aligned_address = (int_address + align - 1) & ~(align - 1);
+  return (void*)aligned_address;
+}
+
+// ASM file loading
+
+static void load_file(vm_context_t* vm, char* file_name,
+                      instr_t** instr_ptr) {
+  FILE* file = fopen(file_name, "r");
+  if (file == NULL)
+    fail("cannot open file %s", file_name);
+
+  char line[1000];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    instr_t instr;
+    int read_count = sscanf(line, "%8x", &instr);
+    if (read_count != 1)
+      fail("error while reading file %s", file_name);
+
+    engine_emit(vm, instr, instr_ptr);
+  }
+
+  fclose(file);
+}
+
+void program_load(vm_context_t* vm, char* file_name, size_t memory_size) {
+  const int value_align = alignof(value_t);
+
+  memory_setup(vm, align_down(memory_size, value_align));
+  engine_setup(vm);
+
+  instr_t* instr_ptr = memory_get_start(vm);
+  load_file(vm, file_name, &instr_ptr);
+  vm->code_end = instr_ptr;
+  memory_set_heap_start(vm, align_up(instr_ptr, value_align));
+}
+
+void program_unload(vm_context_t* vm) {
+  engine_cleanup(vm);
+  memory_cleanup(vm);
+}
@@ -0,0 +1,14 @@
+#ifndef PROGRAM_H
+#define PROGRAM_H
+
+#include <stddef.h>
+#include "vm_context.h"
+
+/* Setup the memory and the interpreter of vm, and load the assembly file
+ * file_name in the code area */
+void program_load(vm_context_t* vm, char* file_name, size_t memory_size);
+
+/* Tear down the interpreter and the memory */
+void program_unload(vm_context_t* vm);
+
+#endif // PROGRAM_H
@@ -0,0 +1,181 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "server.h"
+#include "program.h"
+#include "optimizer.h"
+#include "engine.h"
+#include "memory.h"
+#include "io.h"
+#include "fail.h"
+
+static volatile sig_atomic_t stop_requested = 0;
+
+typedef struct {
+  vm_context_t* vm;
+  int conn_fd;
+  bool writer_thread;
+} job_t;
+
+// Signals
+
+static void handle_stop_signal(int signal_number) {
+  (void)signal_number;
+  stop_requested = 1;
+}
+
+/* Stop on SIGINT and SIGTERM, interrupting accept and wait; a client
+   that goes away only makes its job fail */
+static void setup_signals(void) {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handle_stop_signal;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+}
+
+// Socket
+
+static int open_socket(const char* path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  size_t path_len = strlen(path);
+  if (path_len >= sizeof(addr.sun_path))
+    fail("socket path too long: %s", path);
+  memcpy(addr.sun_path, path, path_len + 1);
+
+  /* replace the socket of a previous server, but nothing else */
+  struct stat info;
+  if (stat(path, &info) == 0 && S_ISSOCK(info.st_mode))
+    unlink(path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    fail("cannot create socket: %s", strerror(errno));
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    fail("cannot bind socket %s: %s", path, strerror(errno));
+  if (listen(fd, SOMAXCONN) != 0)
+    fail("cannot listen on socket %s: %s", path, strerror(errno));
+  return fd;
+}
+
+// Jobs
+
+static void run_job(void* arg) {
+  job_t* job = arg;
+  job->vm->io = io_setup(job->conn_fd, job->conn_fd, job->writer_thread);
+  io_flush_on_fail(job->vm->io);
+  engine_run(job->vm);
+}
+
+static void finish_job(void* arg) {
+  job_t* job = arg;
+  if (job->vm->io != NULL) {
+    io_t* io = job->vm->io;
+    job->vm->io = NULL;
+    io_cleanup(io);
+  }
+}
+
+static void serve(vm_context_t* vm, int listen_fd, bool writer_thread) {
+  while (!stop_requested) {
+    int conn_fd = accept(listen_fd, NULL, NULL);
+    if (conn_fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      fail("cannot accept connection: %s", strerror(errno));
+    }
+
+    job_t job = { vm, conn_fd, writer_thread };
+    fail_try(run_job, &job);
+    fail_try(finish_job, &job);
+    close(conn_fd);
+    memory_reset(vm);
+  }
+}
+
+// Prefork pool
+
+static pid_t start_worker(vm_context_t* vm, int listen_fd, bool writer_thread) {
+  pid_t pid = fork();
+  if (pid < 0)
+    fail("cannot fork worker: %s", strerror(errno));
+  if (pid == 0) {
+    serve(vm, listen_fd, writer_thread);
+    program_unload(vm);
+    exit(0);
+  }
+  return pid;
+}
+
+static void run_workers(vm_context_t* vm, int listen_fd,
+                        const server_options_t* options) {
+  pid_t* pids = calloc(options->workers, sizeof(pid_t));
+  if (pids == NULL)
+    fail("cannot allocate worker table");
+
+  /* the children must not flush the parent's buffers again */
+  fflush(stdout);
+  fflush(stderr);
+  for (unsigned int w = 0; w < options->workers; ++w)
+    pids[w] = start_worker(vm, listen_fd, options->writer_thread);
+
+  while (!stop_requested) {
+    pid_t pid = wait(NULL);
+    if (pid < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    for (unsigned int w = 0; w < options->workers; ++w) {
+      if (pids[w] == pid) {
+        pids[w] = 0;
+        if (!stop_requested) {
+          fprintf(stderr, "worker %d exited, restarting it\n", (int)pid);
+          pids[w] = start_worker(vm, listen_fd, options->writer_thread);
+        }
+      }
+    }
+  }
+
+  for (unsigned int w = 0; w < options->workers; ++w) {
+    if (pids[w] > 0)
+      kill(pids[w], SIGTERM);
+  }
+  while (wait(NULL) > 0 || errno == EINTR)
+    ;
+  free(pids);
+}
+
+void server_run(const server_options_t* options) {
+  vm_context_t vm = { 0 };
+  program_load(&vm, options->file_name, options->memory_size);
+  if (options->optimize) {
+    optimizer_stats_t optimizer_stats;
+    optimizer_run(&vm, &optimizer_stats);
+  }
+  int listen_fd = open_socket(options->socket_path);
+  setup_signals();
+
+  if (options->workers == 0)
+    serve(&vm, listen_fd, options->writer_thread);
+  else
+    run_workers(&vm, listen_fd, options);
+
+  close(listen_fd);
+  unlink(options->socket_path);
+  program_unload(&vm);
+}
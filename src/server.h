@@ -0,0 +1,28 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef struct {
+  char* socket_path;            /* Unix socket to listen on */
+  char* file_name;              /* assembly file run by every job */
+  size_t memory_size;
+  unsigned int workers;         /* preforked processes, 0 for none */
+  bool optimize;                /* run the optimizer after loading */
+  bool writer_thread;
+} server_options_t;
+
+/* Load the program once, then serve jobs on a Unix stream socket until
+ * SIGINT or SIGTERM. Each connection is a job: the program is run with
+ * the connection as its standard input and output, so a client sends
+ * the input, shuts down its side for writing and reads the output until
+ * the server closes the connection. Between jobs, only the part of the
+ * heap used by the previous job is cleared.
+ *
+ * With workers > 0, that many processes are forked after loading the
+ * program, sharing its code pages copy-on-write, and accept the
+ * connections; a worker that dies is replaced. */
+void server_run(const server_options_t* options);
+
+#endif // SERVER_H
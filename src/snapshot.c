@@ -0,0 +1,187 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+#include "engine.h"
+#include "memory.h"
+#include "io.h"
+#include "fail.h"
+
+// Virtual <-> physical address translation
+
+static void* addr_v_to_p(void* memory_start, uvalue_t v_addr) {
+  return (char*)memory_start + v_addr;
+}
+
+static uvalue_t addr_p_to_v(void* memory_start, void* p_addr) {
+  return (uvalue_t)((char*)p_addr - (char*)memory_start);
+}
+
+// Memory area
+
+static size_t area_offset(FILE* file) {
+  long offset = ftell(file);
+  if (offset < 0)
+    fail("cannot get snapshot offset: %s", strerror(errno));
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  return ((size_t)offset + page_size - 1) / page_size * page_size;
+}
+
+static bool is_zero(const char* bytes, size_t length) {
+  for (size_t i = 0; i < length; ++i) {
+    if (bytes[i] != 0)
+      return false;
+  }
+  return true;
+}
+
+void snapshot_write_area(FILE* file, const void* area, size_t size) {
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  size_t start = area_offset(file);
+  const char* bytes = area;
+  for (size_t done = 0; done < size; done += page_size) {
+    size_t length = size - done < page_size ? size - done : page_size;
+    if (is_zero(bytes + done, length))
+      continue;
+    if (fseek(file, (long)(start + done), SEEK_SET) != 0
+        || fwrite(bytes + done, 1, length, file) != length)
+      fail("cannot write snapshot memory: %s", strerror(errno));
+  }
+
+  /* extend the file over the trailing zero pages */
+  if (fflush(file) != 0
+      || ftruncate(fileno(file), (off_t)(start + size)) != 0)
+    fail("cannot write snapshot memory: %s", strerror(errno));
+}
+
+void* snapshot_map_area(FILE* file, size_t size) {
+  size_t start = area_offset(file);
+  struct stat info;
+  if (fstat(fileno(file), &info) != 0)
+    fail("cannot read snapshot: %s", strerror(errno));
+  if ((size_t)info.st_size < start + size)
+    fail("truncated snapshot");
+
+  void* area = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                    fileno(file), (off_t)start);
+  if (area == MAP_FAILED)
+    fail("cannot map snapshot memory: %s", strerror(errno));
+  return area;
+}
+
+void snapshot_unmap_area(void* area, size_t size) {
+  munmap(area, size);
+}
+
+// Snapshots
+
+/* Run the program with an empty non-blocking input until its first input
+   instruction blocks, keeping its output in a temporary file */
+static engine_status_t run_to_input(vm_context_t* vm, FILE* output) {
+  int input[2];
+  if (pipe(input) != 0)
+    fail("cannot create snapshot input: %s", strerror(errno));
+  int flags = fcntl(input[0], F_GETFL);
+  if (flags < 0 || fcntl(input[0], F_SETFL, flags | O_NONBLOCK) < 0)
+    fail("cannot make snapshot input non-blocking");
+
+  vm->io = io_setup(input[0], fileno(output), false);
+  io_flush_on_fail(vm->io);
+  engine_start(vm);
+  engine_status_t status;
+  do {
+    status = engine_resume(vm, UINT64_MAX);
+  } while (status == engine_YIELDED);
+  io_cleanup(vm->io);
+  vm->io = NULL;
+
+  close(input[0]);
+  close(input[1]);
+  return status;
+}
+
+static void copy_output(FILE* output, FILE* file) {
+  char buffer[4096];
+  rewind(output);
+  size_t count;
+  while ((count = fread(buffer, 1, sizeof(buffer), output)) > 0) {
+    if (fwrite(buffer, 1, count, file) != count)
+      fail("cannot write snapshot output: %s", strerror(errno));
+  }
+}
+
+void snapshot_create(vm_context_t* vm, const char* file_name) {
+  FILE* output = tmpfile();
+  if (output == NULL)
+    fail("cannot create snapshot output: %s", strerror(errno));
+  if (run_to_input(vm, output) == engine_HALTED)
+    fail("program halted before reading its input, no snapshot written");
+
+  off_t output_size = lseek(fileno(output), 0, SEEK_END);
+  if (output_size < 0)
+    fail("cannot read snapshot output: %s", strerror(errno));
+
+  FILE* file = fopen(file_name, "wb");
+  if (file == NULL)
+    fail("cannot open snapshot file %s", file_name);
+
+  snapshot_header_t header = {
+    .magic = SNAPSHOT_MAGIC,
+    .version = SNAPSHOT_VERSION,
+    .pc = addr_p_to_v(vm->memory_start, vm->pc),
+    .Lb = addr_p_to_v(vm->memory_start, engine_get_Lb(vm)),
+    .Ib = addr_p_to_v(vm->memory_start, engine_get_Ib(vm)),
+    .Ob = addr_p_to_v(vm->memory_start, engine_get_Ob(vm)),
+    .output_size = (uint64_t)output_size
+  };
+  strncpy(header.memory_identity, memory_get_identity(),
+          sizeof(header.memory_identity) - 1);
+  if (fwrite(&header, sizeof(header), 1, file) != 1)
+    fail("cannot write snapshot file %s", file_name);
+  copy_output(output, file);
+  fclose(output);
+
+  memory_save(vm, file);
+  if (fclose(file) != 0)
+    fail("cannot write snapshot file %s", file_name);
+}
+
+void snapshot_restore(vm_context_t* vm, const char* file_name) {
+  FILE* file = fopen(file_name, "rb");
+  if (file == NULL)
+    fail("cannot open snapshot file %s", file_name);
+
+  snapshot_header_t header;
+  if (fread(&header, sizeof(header), 1, file) != 1
+      || header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION)
+    fail("%s is not a snapshot", file_name);
+  header.memory_identity[sizeof(header.memory_identity) - 1] = '\0';
+  if (strcmp(header.memory_identity, memory_get_identity()) != 0)
+    fail("snapshot %s was written by another memory module (%s)",
+         file_name, header.memory_identity);
+
+  for (uint64_t i = 0; i < header.output_size; ++i) {
+    int byte = fgetc(file);
+    if (byte == EOF)
+      fail("truncated snapshot");
+    io_write_byte(vm->io, (uint8_t)byte);
+  }
+
+  memory_restore(vm, file);
+  engine_setup(vm);
+  engine_set_Lb(vm, addr_v_to_p(vm->memory_start, header.Lb));
+  engine_set_Ib(vm, addr_v_to_p(vm->memory_start, header.Ib));
+  engine_set_Ob(vm, addr_v_to_p(vm->memory_start, header.Ob));
+  vm->pc = addr_v_to_p(vm->memory_start, header.pc);
+
+  /* the mapping outlives the file */
+  fclose(file);
+}
@@ -0,0 +1,56 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include "vm_context.h"
+
+/* A snapshot holds a program suspended just before its first input
+ * instruction, after it has built its tables. The file contains
+ *
+ *   - a snapshot_header_t,
+ *   - the output written by the program before the snapshot,
+ *   - the allocator state, written by memory_save,
+ *   - the memory area (code, bitmap and heap), page-aligned, with its
+ *     zero pages left as holes.
+ *
+ * Heap words and the saved registers are virtual addresses, so the
+ * memory area can be mapped anywhere. A snapshot can only be restored by
+ * the same vm binary on the same kind of machine. */
+
+#define SNAPSHOT_MAGIC 0x4E53334C /* "L3SN" */
+#define SNAPSHOT_VERSION 1
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  char memory_identity[64];     /* memory module that wrote the snapshot */
+  uvalue_t pc;                  /* the suspended input instruction */
+  uvalue_t Lb, Ib, Ob;          /* register banks */
+  uint64_t output_size;         /* bytes written before the snapshot */
+} snapshot_header_t;
+
+/* Run the program loaded in vm until it executes BREA or BRDB for the
+ * first time, without giving it any input, then write the snapshot to
+ * file_name. Fail if the program halts before reading its input. */
+void snapshot_create(vm_context_t* vm, const char* file_name);
+
+/* Setup vm from the snapshot file_name, its memory area being mapped
+ * copy-on-write so that only the pages written by the program are
+ * copied, and write the output of the program before the snapshot to
+ * vm->io, which must be set up. The program is then continued with
+ * engine_continue or engine_resume. */
+void snapshot_restore(vm_context_t* vm, const char* file_name);
+
+/* Write a memory area of size bytes to file at the next page-aligned
+ * offset, skipping its zero pages (used by memory_save) */
+void snapshot_write_area(FILE* file, const void* area, size_t size);
+
+/* Map copy-on-write the memory area of size bytes written at the next
+ * page-aligned offset of file (used by memory_restore) */
+void* snapshot_map_area(FILE* file, size_t size);
+
+/* Unmap an area returned by snapshot_map_area */
+void snapshot_unmap_area(void* area, size_t size);
+
+#endif // SNAPSHOT_H
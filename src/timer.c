@@ -0,0 +1,11 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <time.h>
+
+#include "timer.h"
+
+double timer_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
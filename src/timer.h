@@ -0,0 +1,7 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+/* Seconds elapsed since an arbitrary point, from a monotonic clock */
+double timer_now(void);
+
+#endif // TIMER_H
@@ -0,0 +1,38 @@
+#ifndef VM_CONTEXT_H
+#define VM_CONTEXT_H
+
+#include "vmtypes.h"
+#include "io.h"
+
+/* The state of one virtual machine. The engine, memory and program
+ * modules keep no state of their own: every function takes the context
+ * it acts on, so that several programs can run in the same process,
+ * each one on its own thread. */
+
+typedef struct memory memory_t; /* private to the memory module */
+
+typedef struct {
+  void* memory_start;
+  void* memory_end;
+  instr_t* code_end;            /* end of the code loaded by program_load */
+  uvalue_t* R[8];               /* (pseudo)base registers */
+  instr_t* pc;                  /* next instruction while suspended */
+  uvalue_t halt_code;           /* value given to HALT */
+  memory_t* memory;             /* allocator and garbage collector state */
+  io_t* io;                     /* standard input and output of the program */
+#ifdef ALLOC_PROFILE
+  instr_t* alloc_site;          /* last RALO/BALO instruction executed */
+#endif
+#ifdef GC_STATS
+  uint64_t instr_count;         /* instructions executed */
+  /* instructions that the code would have executed without the
+   * optimizer, but were saved by it: executing the instruction at index
+   * i of the code saves saved_at[i] of them, and taking the conditional
+   * jump at i saves saved_if_taken[i] more (NULL if not optimized) */
+  uint64_t instr_saved;
+  uint32_t* saved_at;
+  uint32_t* saved_if_taken;
+#endif
+} vm_context_t;
+
+#endif // VM_CONTEXT_H
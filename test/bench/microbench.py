@@ -0,0 +1,656 @@
+#!/usr/bin/env python3
+
+# Synthetic L3 microbenchmarks
+#
+# Every benchmark is generated as an .asm file, in the format produced by
+# the L3 compiler, together with its expected output, computed here. The
+# benchmarks isolate one cost of the VM each: dispatch of arithmetic
+# instructions, CALL/RET and TCAL, block access with BGET/BSET, and
+# allocation with various size distributions and survival rates.
+#
+# Usage: microbench.py [-n runs] <vm binary> <output directory>
+
+import os
+import sys
+import json
+import argparse
+import subprocess
+
+MASK32 = 0xFFFFFFFF
+
+OPCODES = ['ADD', 'SUB', 'MUL', 'DIV', 'MOD',
+           'LSL', 'LSR', 'AND', 'OR', 'XOR',
+           'JLT', 'JLE', 'JEQ', 'JNE', 'JI',
+           'TCAL', 'CALL', 'RET', 'HALT',
+           'LDLO', 'LDHI', 'MOVE',
+           'RALO', 'BALO', 'BSIZ', 'BTAG', 'BGET', 'BSET',
+           'BREA', 'BWRI', 'BRDB', 'BWRB',
+           'BCPY', 'BFIL', 'BCMP']
+OP = {name: code for code, name in enumerate(OPCODES)}
+
+
+def L(n):
+    assert 0 <= n < 192
+    return n
+
+
+def I(n):
+    return 192 + n
+
+
+def O(n):
+    return 224 + n
+
+
+def reg_name(r):
+    if r >= 224:
+        return 'O{}'.format(r - 224)
+    if r >= 192:
+        return 'I{}'.format(r - 192)
+    return 'L{}'.format(r)
+
+
+class Asm:
+    """A minimal assembler producing the compiler's .asm format"""
+
+    def __init__(self):
+        self.code = []          # [instruction, text] or a fixup
+        self.labels = {}
+
+    def label(self, name):
+        assert name not in self.labels
+        self.labels[name] = len(self.code)
+
+    def addr(self, name):
+        return self.labels[name] * 4
+
+    def emit(self, word, text):
+        self.code.append([word & MASK32, text])
+
+    def abc(self, op, a, b=0, c=0):
+        args = [reg_name(r) for r in (a, b, c)]
+        text = '{}({})'.format(op, ','.join(args))
+        self.emit((OP[op] << 26) | (a << 18) | (b << 10) | (c << 2), text)
+
+    def ab(self, op, a, b):
+        self.emit((OP[op] << 26) | (a << 18) | (b << 10),
+                  '{}({},{})'.format(op, reg_name(a), reg_name(b)))
+
+    def a(self, op, a):
+        self.emit((OP[op] << 26) | (a << 18), '{}({})'.format(op, reg_name(a)))
+
+    def jcc(self, op, a, b, target):
+        self.code.append(('jcc', op, a, b, target))
+
+    def ji(self, target):
+        self.code.append(('ji', target))
+
+    def ldlo(self, a, value):
+        assert -(1 << 17) <= value < (1 << 17)
+        self.emit((OP['LDLO'] << 26) | (a << 18) | (value & 0x3FFFF),
+                  'LDLO({},{})'.format(reg_name(a), value))
+
+    def ldhi(self, a, value):
+        self.emit((OP['LDHI'] << 26) | (a << 18) | (value & 0xFFFF),
+                  'LDHI({},{})'.format(reg_name(a), value))
+
+    def const(self, a, value):
+        """Load any 32-bit constant"""
+        value &= MASK32
+        signed = value - (1 << 32) if value & 0x80000000 else value
+        if -(1 << 17) <= signed < (1 << 17):
+            self.ldlo(a, signed)
+        else:
+            self.ldlo(a, value & 0xFFFF)
+            self.ldhi(a, value >> 16)
+
+    def ldaddr(self, a, target):
+        self.code.append(('ldaddr', a, target))
+
+    def ralo(self, bank, size):
+        banks = {'Lb': 0, 'Ib': 1, 'Ob': 2}
+        self.emit((OP['RALO'] << 26) | (banks[bank] << 24) | (size << 16),
+                  'RALO({},{})'.format(bank, size))
+
+    def balo(self, a, b, tag):
+        self.emit((OP['BALO'] << 26) | (a << 18) | (b << 10) | (tag << 2),
+                  'BALO({},{},{})'.format(reg_name(a), reg_name(b), tag))
+
+    def ext(self, d, e=0):
+        """Extension word of a two-word instruction (BCPY, BFIL)"""
+        self.emit((d << 18) | (e << 10), '  ({},{})'.format(reg_name(d), reg_name(e)))
+
+    def ret(self):
+        self.emit(OP['RET'] << 26, 'RET')
+
+    def assemble(self):
+        lines = []
+        for pc, item in enumerate(self.code):
+            if isinstance(item, list):
+                word, text = item
+            elif item[0] == 'jcc':
+                _, op, a, b, target = item
+                d = self.labels[target] - pc
+                assert -512 <= d < 512, 'branch out of range'
+                word = (OP[op] << 26) | (a << 18) | (b << 10) | (d & 0x3FF)
+                text = '{}({},{},{})'.format(op, reg_name(a), reg_name(b), d)
+            elif item[0] == 'ji':
+                d = self.labels[item[1]] - pc
+                word = (OP['JI'] << 26) | (d & 0x3FFFFFF)
+                text = 'JI({})'.format(d)
+            else:
+                _, a, target = item
+                value = self.addr(target)
+                word = (OP['LDLO'] << 26) | (a << 18) | (value & 0x3FFFF)
+                text = 'LDLO({},{})'.format(reg_name(a), value)
+            lines.append('{:08x}  {}\n'.format(word & MASK32, text))
+        return ''.join(lines)
+
+
+# Shared routines
+
+def emit_print(asm):
+    """print(I4): write the non-negative value I4 in decimal and a newline"""
+    asm.label('print')
+    asm.ralo('Lb', 5)
+    asm.ab('MOVE', L(0), I(4))
+    asm.ldlo(L(1), 10)
+    asm.ldlo(L(2), 1)
+    asm.label('print_scale')              # while (v / div >= 10) div *= 10
+    asm.abc('DIV', L(3), L(0), L(2))
+    asm.jcc('JLT', L(3), L(1), 'print_digits')
+    asm.abc('MUL', L(2), L(2), L(1))
+    asm.ji('print_scale')
+    asm.label('print_digits')
+    asm.ldlo(L(4), ord('0'))
+    asm.abc('DIV', L(3), L(0), L(2))
+    asm.abc('ADD', L(3), L(3), L(4))
+    asm.a('BWRI', L(3))
+    asm.abc('MOD', L(0), L(0), L(2))
+    asm.abc('DIV', L(2), L(2), L(1))
+    asm.ldlo(L(4), 0)
+    asm.jcc('JLT', L(4), L(2), 'print_digits')
+    asm.a('BWRI', L(1))                   # L1 is 10, a newline
+    asm.ret()
+
+
+def emit_main_prologue(asm):
+    asm.ralo('Lb', 32)
+    asm.ralo('Ob', 8)
+
+
+def emit_print_call(asm, reg):
+    """Print reg, masked to 31 bits, clobbers L30 and L31"""
+    asm.ldlo(L(31), -1)
+    asm.ldlo(L(30), 1)
+    asm.abc('LSR', L(31), L(31), L(30))
+    asm.abc('AND', O(4), reg, L(31))
+    asm.ldaddr(L(31), 'print')
+    asm.a('CALL', L(31))
+
+
+def emit_halt(asm):
+    asm.ldlo(L(31), 0)
+    asm.a('HALT', L(31))
+
+
+# Benchmarks
+#
+# Each one returns (assembler, expected output, iterations, memory size)
+
+def bench_arith(n=5000000):
+    asm = Asm()
+    emit_main_prologue(asm)
+    asm.ldlo(L(0), 1)                     # acc
+    asm.ldlo(L(1), 0)                     # i
+    asm.const(L(2), n)
+    asm.const(L(3), 1664525)
+    asm.ldlo(L(4), 13)
+    asm.ldlo(L(5), 1)
+    asm.label('loop')
+    asm.abc('MUL', L(0), L(0), L(3))
+    asm.abc('ADD', L(0), L(0), L(1))
+    asm.abc('LSR', L(6), L(0), L(4))
+    asm.abc('XOR', L(0), L(0), L(6))
+    asm.abc('ADD', L(1), L(1), L(5))
+    asm.jcc('JLT', L(1), L(2), 'loop')
+    emit_print_call(asm, L(0))
+    emit_halt(asm)
+    emit_print(asm)
+
+    acc = 1
+    for i in range(n):
+        acc = (acc * 1664525 + i) & MASK32
+        acc ^= acc >> 13
+    return asm, '{}\n'.format(acc & 0x7FFFFFFF), n, 1000000
+
+
+def bench_fib(n=25):
+    asm = Asm()
+    emit_main_prologue(asm)
+    asm.ldlo(O(4), n)
+    asm.ldaddr(L(0), 'fib')
+    asm.a('CALL', L(0))
+    asm.ab('MOVE', L(1), O(0))
+    emit_print_call(asm, L(1))
+    emit_halt(asm)
+
+    asm.label('fib')                      # fib(I4)
+    asm.ralo('Lb', 4)
+    asm.ldlo(L(0), 2)
+    asm.jcc('JLT', I(4), L(0), 'fib_base')
+    asm.ralo('Ob', 5)
+    asm.ldaddr(L(3), 'fib')
+    asm.ldlo(L(1), 1)
+    asm.abc('SUB', O(4), I(4), L(1))
+    asm.a('CALL', L(3))
+    asm.ab('MOVE', L(2), O(0))
+    asm.abc('SUB', O(4), I(4), L(0))
+    asm.a('CALL', L(3))
+    asm.abc('ADD', I(4), L(2), O(0))
+    asm.label('fib_base')
+    asm.ret()
+    emit_print(asm)
+
+    def fib(k):
+        a, b = 0, 1
+        for _ in range(k):
+            a, b = b, a + b
+        return a
+    calls = 2 * fib(n + 1) - 1
+    return asm, '{}\n'.format(fib(n)), calls, 1000000
+
+
+def bench_deep(depth=10000, repeat=100):
+    asm = Asm()
+    emit_main_prologue(asm)
+    asm.ldlo(L(0), 0)                     # total
+    asm.ldlo(L(1), 0)                     # r
+    asm.const(L(2), repeat)
+    asm.ldlo(L(3), 1)
+    asm.ldaddr(L(4), 'sum')
+    asm.label('loop')
+    asm.const(O(4), depth)
+    asm.a('CALL', L(4))
+    asm.abc('ADD', L(0), L(0), O(0))
+    asm.abc('ADD', L(1), L(1), L(3))
+    asm.jcc('JLT', L(1), L(2), 'loop')
+    emit_print_call(asm, L(0))
+    emit_halt(asm)
+
+    asm.label('sum')                      # sum(I4) = I4 + sum(I4 - 1)
+    asm.ralo('Lb', 2)
+    asm.ldlo(L(0), 0)
+    asm.jcc('JEQ', I(4), L(0), 'sum_base')
+    asm.ralo('Ob', 5)
+    asm.ldlo(L(0), 1)
+    asm.abc('SUB', O(4), I(4), L(0))
+    asm.ldaddr(L(1), 'sum')
+    asm.a('CALL', L(1))
+    asm.abc('ADD', I(4), I(4), O(0))
+    asm.label('sum_base')
+    asm.ret()
+    emit_print(asm)
+
+    total = (repeat * (depth * (depth + 1) // 2)) & MASK32
+    return asm, '{}\n'.format(total & 0x7FFFFFFF), depth * repeat, 4000000
+
+
+def bench_tcal(n=1000000):
+    asm = Asm()
+    emit_main_prologue(asm)
+    asm.const(O(4), n)
+    asm.ldlo(O(5), 0)
+    asm.ldaddr(L(0), 'loop')
+    asm.a('CALL', L(0))
+    asm.ab('MOVE', L(1), O(0))
+    emit_print_call(asm, L(1))
+    emit_halt(asm)
+
+    asm.label('loop')                     # loop(n, acc), tail-recursive
+    asm.ralo('Lb', 4)
+    asm.ldlo(L(0), 0)
+    asm.jcc('JEQ', I(4), L(0), 'loop_end')
+    asm.ralo('Ob', 6)
+    asm.ldlo(L(1), 1)
+    asm.ldlo(L(2), 3)
+    asm.abc('SUB', O(4), I(4), L(1))
+    asm.abc('LSR', L(3), I(4), L(2))
+    asm.abc('XOR', L(3), L(3), I(4))
+    asm.abc('ADD', O(5), I(5), L(3))
+    asm.ldaddr(L(3), 'loop')
+    asm.a('TCAL', L(3))
+    asm.label('loop_end')
+    asm.ab('MOVE', I(4), I(5))
+    asm.ret()
+    emit_print(asm)
+
+    acc = 0
+    for k in range(n, 0, -1):
+        acc = (acc + ((k >> 3) ^ k)) & MASK32
+    return asm, '{}\n'.format(acc & 0x7FFFFFFF), n, 1000000
+
+
+def bench_stream(size=65536, passes=40):
+    asm = Asm()
+    emit_main_prologue(asm)
+    asm.const(L(0), size)
+    asm.balo(L(1), L(0), 0)               # the block
+    asm.ldlo(L(2), 0)                     # sum
+    asm.ldlo(L(3), 0)                     # pass
+    asm.const(L(4), passes)
+    asm.ldlo(L(5), 1)
+    asm.label('pass')
+    asm.ldlo(L(6), 0)                     # i
+    asm.label('fill')                     # block[i] = (i ^ pass) | 1
+    asm.abc('XOR', L(7), L(6), L(3))
+    asm.abc('OR', L(7), L(7), L(5))
+    asm.abc('BSET', L(7), L(1), L(6))
+    asm.abc('ADD', L(6), L(6), L(5))
+    asm.jcc('JLT', L(6), L(0), 'fill')
+    asm.ldlo(L(6), 0)
+    asm.label('read')                     # sum += block[i]
+    asm.abc('BGET', L(7), L(1), L(6))
+    asm.abc('ADD', L(2), L(2), L(7))
+    asm.abc('ADD', L(6), L(6), L(5))
+    asm.jcc('JLT', L(6), L(0), 'read')
+    asm.abc('ADD', L(3), L(3), L(5))
+    asm.jcc('JLT', L(3), L(4), 'pass')
+    emit_print_call(asm, L(2))
+    emit_halt(asm)
+    emit_print(asm)
+
+    total = 0
+    for p in range(passes):
+        for i in range(size):
+            total += (i ^ p) | 1
+    return asm, '{}\n'.format(total & MASK32 & 0x7FFFFFFF), size * passes, 1000000
+
+
+def bench_write(n=2000000):
+    asm = Asm()
+    emit_main_prologue(asm)
+    asm.ldlo(L(0), 0)                     # i
+    asm.const(L(1), n)
+    asm.ldlo(L(2), 1)
+    asm.ldlo(L(3), 63)
+    asm.ldlo(L(4), ord('0'))
+    asm.label('loop')                     # write chr(48 + (i & 63))
+    asm.abc('AND', L(5), L(0), L(3))
+    asm.abc('ADD', L(5), L(5), L(4))
+    asm.a('BWRI', L(5))
+    asm.abc('ADD', L(0), L(0), L(2))
+    asm.jcc('JLT', L(0), L(1), 'loop')
+    emit_halt(asm)
+
+    expected = ''.join(chr(48 + (i & 63)) for i in range(n))
+    return asm, expected, n, 1000000
+
+
+def bench_write_block(n=2000000):
+    asm = Asm()
+    emit_main_prologue(asm)
+    asm.ldlo(L(0), 0)                     # i
+    asm.ldlo(L(1), 64)
+    asm.balo(L(2), L(1), 0)
+    asm.ldlo(L(3), 1)
+    asm.ldlo(L(4), ord('0'))
+    asm.label('fill')                     # block[i] = chr(48 + i)
+    asm.abc('ADD', L(5), L(0), L(4))
+    asm.abc('BSET', L(5), L(2), L(0))
+    asm.abc('ADD', L(0), L(0), L(3))
+    asm.jcc('JLT', L(0), L(1), 'fill')
+    asm.ldlo(L(0), 0)
+    asm.const(L(6), n // 64)
+    asm.ldlo(L(7), 0)
+    asm.label('loop')                     # write the whole block
+    asm.abc('BWRB', L(2), L(7), L(1))
+    asm.abc('ADD', L(0), L(0), L(3))
+    asm.jcc('JLT', L(0), L(6), 'loop')
+    emit_halt(asm)
+
+    expected = ''.join(chr(48 + (i & 63)) for i in range(n // 64 * 64))
+    return asm, expected, n // 64 * 64, 1000000
+
+
+def emit_sum_block(asm, block, size, result):
+    """result = sum of the words of block, clobbers L20 to L22"""
+    asm.ldlo(result, 0)
+    asm.ldlo(L(20), 0)
+    asm.ldlo(L(21), 1)
+    asm.label('sum_block')
+    asm.abc('BGET', L(22), block, L(20))
+    asm.abc('ADD', result, result, L(22))
+    asm.abc('ADD', L(20), L(20), L(21))
+    asm.jcc('JLT', L(20), size, 'sum_block')
+
+
+def emit_fill_odd(asm, block, size):
+    """block[i] = 2i + 1, clobbers L20 to L22"""
+    asm.ldlo(L(20), 0)
+    asm.ldlo(L(21), 1)
+    asm.label('fill_odd')
+    asm.abc('ADD', L(22), L(20), L(20))
+    asm.abc('OR', L(22), L(22), L(21))
+    asm.abc('BSET', L(22), block, L(20))
+    asm.abc('ADD', L(20), L(20), L(21))
+    asm.jcc('JLT', L(20), size, 'fill_odd')
+
+
+def bench_copy(use_bcpy, size=4096, passes=500):
+    """Copy block A to block B, with BCPY or a BGET/BSET loop; A changes
+    a little at every pass"""
+    asm = Asm()
+    emit_main_prologue(asm)
+    asm.const(L(0), size)
+    asm.balo(L(1), L(0), 0)               # A
+    asm.balo(L(2), L(0), 0)               # B
+    emit_fill_odd(asm, L(1), L(0))
+    asm.ldlo(L(3), 0)                     # pass
+    asm.const(L(4), passes)
+    asm.ldlo(L(5), 1)
+    asm.ldlo(L(6), 0)
+    asm.label('pass')                     # A[pass % size] = 2 pass + 1
+    asm.abc('MOD', L(7), L(3), L(0))
+    asm.abc('ADD', L(8), L(3), L(3))
+    asm.abc('OR', L(8), L(8), L(5))
+    asm.abc('BSET', L(8), L(1), L(7))
+    if use_bcpy:
+        asm.abc('BCPY', L(2), L(1), L(0))
+        asm.ext(L(6), L(6))
+    else:
+        asm.ldlo(L(7), 0)
+        asm.label('copy')
+        asm.abc('BGET', L(8), L(1), L(7))
+        asm.abc('BSET', L(8), L(2), L(7))
+        asm.abc('ADD', L(7), L(7), L(5))
+        asm.jcc('JLT', L(7), L(0), 'copy')
+    asm.abc('ADD', L(3), L(3), L(5))
+    asm.jcc('JLT', L(3), L(4), 'pass')
+    emit_sum_block(asm, L(2), L(0), L(9))
+    emit_print_call(asm, L(9))
+    emit_halt(asm)
+    emit_print(asm)
+
+    a = [2 * i + 1 for i in range(size)]
+    for p in range(passes):
+        a[p % size] = 2 * p + 1
+    return asm, '{}\n'.format(sum(a) & 0x7FFFFFFF), size * passes, 1000000
+
+
+def bench_fill_block(size=4096, passes=500):
+    asm = Asm()
+    emit_main_prologue(asm)
+    asm.const(L(0), size)
+    asm.balo(L(1), L(0), 0)
+    asm.ldlo(L(3), 0)                     # pass
+    asm.const(L(4), passes)
+    asm.ldlo(L(5), 1)
+    asm.ldlo(L(6), 0)
+    asm.label('pass')
+    asm.abc('OR', L(7), L(3), L(5))
+    asm.abc('BFIL', L(1), L(7), L(0))
+    asm.ext(L(6))
+    asm.abc('ADD', L(3), L(3), L(5))
+    asm.jcc('JLT', L(3), L(4), 'pass')
+    emit_sum_block(asm, L(1), L(0), L(9))
+    emit_print_call(asm, L(9))
+    emit_halt(asm)
+    emit_print(asm)
+
+    total = size * ((passes - 1) | 1)
+    return asm, '{}\n'.format(total & 0x7FFFFFFF), size * passes, 1000000
+
+
+def bench_compare_block(size=4096, passes=500):
+    """Compare two blocks that differ in their last word on odd passes"""
+    asm = Asm()
+    emit_main_prologue(asm)
+    asm.const(L(0), size)
+    asm.balo(L(1), L(0), 0)
+    asm.balo(L(2), L(0), 0)
+    emit_fill_odd(asm, L(1), L(0))
+    asm.ldlo(L(6), 0)
+    asm.abc('BCPY', L(2), L(1), L(0))
+    asm.ext(L(6), L(6))
+    asm.ldlo(L(3), 0)                     # pass
+    asm.const(L(4), passes)
+    asm.ldlo(L(5), 1)
+    asm.abc('SUB', L(10), L(0), L(5))     # index of the last word
+    asm.ldlo(L(11), 0)                    # sum of the results + 1
+    asm.label('pass')
+    asm.abc('AND', L(7), L(3), L(5))
+    asm.abc('BSET', L(7), L(2), L(10))
+    asm.abc('BCMP', L(8), L(1), L(2))
+    asm.abc('ADD', L(8), L(8), L(5))
+    asm.abc('ADD', L(11), L(11), L(8))
+    asm.abc('ADD', L(3), L(3), L(5))
+    asm.jcc('JLT', L(3), L(4), 'pass')
+    emit_print_call(asm, L(11))
+    emit_halt(asm)
+    emit_print(asm)
+
+    last = 2 * (size - 1) + 1
+    total = sum((1 if last > (p & 1) else 0) + 1 for p in range(passes))
+    return asm, '{}\n'.format(total), size * passes, 1000000
+
+
+def bench_churn(n, min_size, size_range, ring_size, keep, memory):
+    """Allocate n blocks of pseudo-random sizes; a block replaces a slot
+    of a ring of survivors with probability keep/8"""
+    asm = Asm()
+    emit_main_prologue(asm)
+    asm.const(L(0), ring_size)
+    asm.balo(L(1), L(0), 0)               # ring
+    asm.ldlo(L(2), 12345)                 # rng state
+    asm.ldlo(L(3), 0)                     # i
+    asm.const(L(4), n)
+    asm.const(L(5), 1103515245)
+    asm.ldlo(L(6), 12345)
+    asm.ldlo(L(7), 16)
+    asm.const(L(8), size_range)
+    asm.const(L(9), min_size)
+    asm.ldlo(L(10), 8)
+    asm.ldlo(L(11), 7)
+    asm.ldlo(L(12), keep)
+    asm.ldlo(L(13), 1)
+    asm.ldlo(L(14), 0)                    # allocated words
+    asm.label('loop')
+    asm.abc('MUL', L(2), L(2), L(5))
+    asm.abc('ADD', L(2), L(2), L(6))
+    asm.abc('LSR', L(15), L(2), L(7))
+    asm.abc('MOD', L(15), L(15), L(8))
+    asm.abc('ADD', L(15), L(15), L(9))    # size
+    asm.abc('ADD', L(14), L(14), L(15))
+    asm.balo(L(16), L(15), 1)
+    asm.abc('LSR', L(17), L(2), L(10))
+    asm.abc('AND', L(17), L(17), L(11))
+    asm.jcc('JLE', L(12), L(17), 'next')
+    asm.abc('MOD', L(18), L(3), L(0))
+    asm.abc('BSET', L(16), L(1), L(18))
+    asm.label('next')
+    asm.abc('ADD', L(3), L(3), L(13))
+    asm.jcc('JLT', L(3), L(4), 'loop')
+    emit_print_call(asm, L(14))
+    asm.ldlo(L(3), 0)                     # sum of the sizes of the survivors
+    asm.ldlo(L(15), 0)
+    asm.label('sum')
+    asm.abc('BGET', L(16), L(1), L(3))
+    asm.ldlo(L(17), 0)
+    asm.jcc('JEQ', L(16), L(17), 'sum_next')
+    asm.ab('BSIZ', L(17), L(16))
+    asm.abc('ADD', L(15), L(15), L(17))
+    asm.label('sum_next')
+    asm.abc('ADD', L(3), L(3), L(13))
+    asm.jcc('JLT', L(3), L(0), 'sum')
+    emit_print_call(asm, L(15))
+    emit_halt(asm)
+    emit_print(asm)
+
+    state, words = 12345, 0
+    ring = [None] * ring_size
+    for i in range(n):
+        state = (state * 1103515245 + 12345) & MASK32
+        size = (state >> 16) % size_range + min_size
+        words = (words + size) & MASK32
+        if ((state >> 8) & 7) < keep:
+            ring[i % ring_size] = size
+    kept = sum(s for s in ring if s is not None)
+    expected = '{}\n{}\n'.format(words & 0x7FFFFFFF, kept & 0x7FFFFFFF)
+    return asm, expected, n, memory
+
+
+BENCHMARKS = {
+    'arith': bench_arith,
+    'fib': bench_fib,
+    'deep': bench_deep,
+    'tcal': bench_tcal,
+    'stream': bench_stream,
+    'write': bench_write,
+    'write_block': bench_write_block,
+    'copy_loop': lambda: bench_copy(False),
+    'copy_block': lambda: bench_copy(True),
+    'fill_block': bench_fill_block,
+    'compare_block': bench_compare_block,
+    'churn_small': lambda: bench_churn(1000000, 0, 4, 64, 1, 1000000),
+    'churn_mixed': lambda: bench_churn(300000, 1, 64, 1024, 2, 1000000),
+    'churn_large': lambda: bench_churn(50000, 256, 1792, 32, 4, 4000000),
+}
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Run the L3 VM microbenchmarks')
+    parser.add_argument('-n', dest='runs', default=5, type=int, help='Number of measured runs')
+    parser.add_argument('vm', help='VM binary')
+    parser.add_argument('dir', help='Directory for the generated files')
+    parser.add_argument('names', nargs='*', help='Benchmarks to run (default: all)')
+    args = parser.parse_args()
+
+    os.makedirs(args.dir, exist_ok=True)
+    failed = False
+    print('{:<12} {:>12} {:>12} {:>12} {:>8}  {}'.format(
+        'benchmark', 'median (s)', 'ns/iter', 'gc (s)', 'gcs', 'output'))
+    for name in args.names or BENCHMARKS:
+        asm, expected, iterations, memory = BENCHMARKS[name]()
+        asm_file = os.path.join(args.dir, name + '.asm')
+        with open(asm_file, 'w') as f:
+            f.write(asm.assemble())
+        with open(os.path.join(args.dir, name + '.out'), 'w') as f:
+            f.write(expected)
+
+        run = subprocess.run([args.vm, '-m', str(memory), asm_file],
+                             stdin=subprocess.DEVNULL, stdout=subprocess.PIPE)
+        ok = run.returncode == 0 and run.stdout.decode() == expected
+        failed |= not ok
+
+        result = json.loads(subprocess.check_output(
+            [args.vm, '-m', str(memory), '-b', str(args.runs), asm_file]))
+        median = result['execution']['median']
+        print('{:<12} {:>12.6f} {:>12.2f} {:>12.6f} {:>8}  {}'.format(
+            name, median, median * 1e9 / iterations, result['gc']['median'],
+            result['gc_count'], 'ok' if ok else 'FAILED'), flush=True)
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())